@@ -0,0 +1,188 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include "types.h"
+#include "bytecode.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <charconv>
+#include <string_view>
+#include <unordered_map>
+
+namespace amps
+{
+    class parser_iterator;
+
+    // lowers the tokens of each metadata into bytecode once, when the
+    // template is compiled, so rendering never parses tokens again.
+    // Syntax errors aren't reported here: they become a FAIL instruction
+    // and are reported when (and if) the statement is executed, exactly
+    // like any other runtime error
+    class assembler
+    {
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        program program_;
+        std::unordered_map<std::string, size_t> strings_;
+        std::unordered_map<std::string, size_t> slots_;
+        std::vector<std::vector<size_t>> blocks_;
+        size_t line_;
+        int depth_;
+
+    private:
+        void track(opcode op);
+        size_t emit(opcode op, size_t a = 0, size_t b = 0);
+        size_t emit(opcode op, token_types oper);
+        size_t intern(std::string_view str);
+        size_t slot(std::string_view name);
+        size_t add_loop(opcode type,
+                        std::string_view key,
+                        std::string_view value);
+
+        // if/elif/else/endif and for/endfor are matched as they're
+        // emitted, each open block keeps the position of its clauses
+        // until the closing statement gives them their jump targets
+        size_t find_block(opcode opener) const;
+        void open_block(size_t pc);
+        void add_clause(size_t pc);
+        void close_block(opcode opener, size_t pc);
+        void link_block(const std::vector<size_t> &clauses, size_t end);
+
+        template <typename... Ts>
+        bool fail(const Ts&... msgs);
+
+        bool lower_statement(parser_iterator &it);
+        bool lower_print(parser_iterator &it);
+        bool lower_for(parser_iterator &it);
+        bool lower_if(parser_iterator &it);
+        bool lower_insert(parser_iterator &it);
+
+        bool parse_expression(parser_iterator &it);
+        bool parse_logical(parser_iterator &it);
+        bool parse_equality(parser_iterator &it);
+        bool parse_comparison(parser_iterator &it);
+        bool parse_addition(parser_iterator &it);
+        bool parse_multiplication(parser_iterator &it);
+        bool parse_unary(parser_iterator &it);
+        bool parse_primary(parser_iterator &it);
+
+    public:
+        assembler() :
+            line_(0),
+            depth_(0)
+        {
+        }
+
+        ~assembler()                            = default;
+
+        assembler(const assembler&)             = delete;
+        assembler(assembler&&)                  = delete;
+        assembler &operator=(const assembler&)  = delete;
+        assembler &operator=(assembler&&)       = delete;
+
+        program assemble(const metainfo &info);
+    };
+
+    template <typename... Ts>
+    bool assembler::fail(const Ts&... msgs)
+    {
+        std::ostringstream message;
+        if constexpr (sizeof...(Ts) > 0) {
+            (message << ... << msgs);
+        }
+        emit(opcode::FAIL, intern(message.str()));
+        return false;
+    }
+
+    class parser_iterator
+    {
+        friend class assembler;
+
+        const tokens &tokens_;
+        std::string_view source_;
+        const metarange &range_;
+        size_t cursor_;
+
+        parser_iterator(const tokens &tks,
+                        std::string_view source,
+                        const metarange &range) :
+            tokens_(tks),
+            source_(source),
+            range_(range),
+            cursor_(0)
+        {
+        }
+
+        bool advance()
+        {
+            if (cursor_ > tokens_.size() - 1) {
+                return false;
+            }
+
+            ++cursor_;
+            return true;
+        }
+
+        bool is_eot() const
+        {
+            if (cursor_ >= tokens_.size()) {
+                return true;
+            }
+
+            return false;
+        }
+
+        const token_t &look() const
+        {
+            return tokens_[cursor_];
+        }
+
+        const token_t &look_back() const
+        {
+            return tokens_[cursor_ - 1];
+        }
+
+        // text of the token just matched, it views the scanned code
+        std::string_view value() const
+        {
+            return look_back().value(source_);
+        }
+
+        // the scanner only accepts digits that fit in 32 bits
+        size_t number() const
+        {
+            std::string_view digits = value();
+            size_t num = 0;
+            std::from_chars(digits.data(), digits.data() + digits.size(), num);
+            return num;
+        }
+
+        void next()
+        {
+            if (is_eot()) {
+                return;
+            }
+
+            advance();
+        }
+
+        metarange range() const
+        {
+            return range_;
+        }
+
+        bool match(token_types type)
+        {
+            if (!is_eot() && tokens_[cursor_].type() == type) {
+                advance();
+                return true;
+            }
+
+            return false;
+        }
+    };
+}
+
+#endif // ASSEMBLER_H
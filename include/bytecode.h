@@ -0,0 +1,127 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "token.h"
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+// statements start with the opcode named after them (PRINT, FOR, IF...)
+// and usually end with the opcode doing the actual work (OUTPUT, TEST,
+// LOOP_*...), the expression evaluation sits in between
+#define OPCODES             \
+    X(TEXT)                 \
+    X(STATIC)               \
+    X(PUSH_NUMBER)          \
+    X(PUSH_STRING)          \
+    X(PUSH_BOOL)            \
+    X(LOAD)                 \
+    X(DEFINED)              \
+    X(LOAD_INDEX)           \
+    X(SIZE)                 \
+    X(UNARY)                \
+    X(BINARY)               \
+    X(JUMP_FALSE)           \
+    X(JUMP_TRUE)            \
+    X(TO_BOOL)              \
+    X(PRINT)                \
+    X(OUTPUT)               \
+    X(IF)                   \
+    X(ELIF)                 \
+    X(TEST)                 \
+    X(ELSE)                 \
+    X(ENDIF)                \
+    X(FOR)                  \
+    X(DECLARE)              \
+    X(COLLECTION)           \
+    X(CHECK_NUMBER)         \
+    X(LOOP_RANGE)           \
+    X(LOOP_EACH)            \
+    X(LOOP_PAIRS)           \
+    X(ENDFOR)               \
+    X(INSERT)               \
+    X(INCLUDE)              \
+    X(FAIL)
+
+namespace amps
+{
+    enum class opcode : uint8_t
+    {
+    #define X(name) name,
+        OPCODES
+    #undef X
+    };
+
+    inline std::string get_opcode_name(opcode op)
+    {
+        switch (op) {
+        #define X(name) case opcode::name: \
+            return std::string(#name);
+            OPCODES
+        #undef X
+
+            default:
+                return "undefined";
+        }
+    }
+
+    inline std::ostream& operator<<(std::ostream &os, const opcode &op)
+    {
+        os << get_opcode_name(op);
+        return os;
+    }
+
+    // operands are resolved when the template is compiled: numbers are
+    // stored inline, strings are indexes into program::strings,
+    // identifiers are indexes into program::slots, the LOOP_* opcodes
+    // refer to program::loops and TEXT to the metadata where the text
+    // starts, its length is b (the optimizer extends it over text next
+    // to it in the source), STATIC is text the optimizer built, it's the
+    // string a.
+    // INCLUDE has the file name in a and its index in program::inserts
+    // in b, the template it inserts is resolved when linking.
+    // Block openers also carry the jump targets matched at compile time:
+    //   IF, ELIF -> a: next ELIF, ELSE or ENDIF
+    //   ELIF     -> b: ENDIF
+    //   ELSE     -> a: ENDIF
+    //   FOR      -> a: ENDFOR
+    // an opener left unmatched jumps to the end of the program.
+    // and/or evaluate their right side only when the left one doesn't
+    // decide the result, JUMP_FALSE/JUMP_TRUE skip to a (the end of the
+    // right side) leaving the left side as a bool when it does
+    struct instruction
+    {
+        opcode op;
+        token_types oper;
+        uint32_t line;
+        size_t a;
+        size_t b;
+    };
+
+    // slots a loop binds while it runs: the loop variable (or key), the
+    // value of a key, value loop and the hidden <key>_idx counter
+    struct loop
+    {
+        opcode type;
+        size_t key;
+        size_t value;
+        size_t index;
+    };
+
+    // the whole template is a single stream of instructions, the code
+    // of the metadata i is in [entries[i], entries[i + 1]). depth is the
+    // most values its expressions ever keep on the stack at once
+    struct program
+    {
+        std::vector<instruction> code;
+        std::vector<std::string> strings;
+        std::vector<std::string> slots;
+        std::vector<loop> loops;
+        std::vector<size_t> inserts;
+        std::vector<size_t> entries;
+        size_t depth;
+    };
+}
+
+#endif // BYTECODE_H
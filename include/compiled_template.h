@@ -0,0 +1,130 @@
+#ifndef COMPILED_TEMPLATE_H
+#define COMPILED_TEMPLATE_H
+
+#include "metadata.h"
+#include "bytecode.h"
+#include "assembler.h"
+
+#include <atomic>
+#include <memory>
+
+namespace amps
+{
+    class compiled_template;
+
+    enum class link_status : uint8_t
+    {
+        LINKED,
+        MISSING,
+        CYCLE,
+    };
+
+    // the template an insert statement resolved to. A file that can't
+    // be read, or that is already being inserted up in the chain, has
+    // no template: it's reported when the insert is executed
+    struct insert_link
+    {
+        link_status status;
+        std::shared_ptr<const compiled_template> unit;
+    };
+
+    // a compiled template is the immutable result of scanning a
+    // template file and lowering it into bytecode. Once built it's
+    // never changed again, so the same instance can be shared (and
+    // rendered) by many threads at the same time, each one using its
+    // own render_state. The only thing a render changes is the size
+    // hint, a relaxed atomic read before the output is reserved and
+    // updated once it's complete
+    class compiled_template
+    {
+        friend class linker;
+
+        metainfo metainfo_;
+        uint64_t hash_;
+        program program_;
+        std::vector<insert_link> links_;
+        std::vector<std::string> dependencies_;
+        size_t static_size_;
+        mutable std::atomic<size_t> size_hint_;
+
+    public:
+        compiled_template(metainfo &&info);
+        ~compiled_template()                                   = default;
+
+        compiled_template(const compiled_template&)            = delete;
+        compiled_template(compiled_template&&)                 = delete;
+        compiled_template &operator=(const compiled_template&) = delete;
+        compiled_template &operator=(compiled_template&&)      = delete;
+
+        const metainfo &get_metainfo() const;
+        const program &get_program() const;
+        const std::vector<insert_link> &get_links() const;
+        const std::vector<std::string> &get_dependencies() const;
+        uint64_t hash() const;
+
+        size_t static_size() const;
+        size_t size_hint() const;
+        void learn_size(size_t size) const;
+    };
+
+    using template_ptr = std::shared_ptr<const compiled_template>;
+
+    inline compiled_template::compiled_template(metainfo &&info) :
+        metainfo_(std::move(info)),
+        hash_(metainfo_.hash()),
+        program_(assembler().assemble(metainfo_)),
+        static_size_(0),
+        size_hint_(0)
+    {
+    }
+
+    inline const metainfo &compiled_template::get_metainfo() const
+    {
+        return metainfo_;
+    }
+
+    inline const program &compiled_template::get_program() const
+    {
+        return program_;
+    }
+
+    inline const std::vector<insert_link> &compiled_template::get_links() const
+    {
+        return links_;
+    }
+
+    // every file the linker looked for, inserted directly or not,
+    // including the ones that couldn't be read
+    inline const std::vector<std::string> &
+    compiled_template::get_dependencies() const
+    {
+        return dependencies_;
+    }
+
+    inline uint64_t compiled_template::hash() const
+    {
+        return hash_;
+    }
+
+    // bytes of text every render prints for sure, known once it's
+    // linked: the text outside any if or for, plus the same for the
+    // templates inserted there. It's a lower bound of the output, what
+    // the data adds is learned from the renders (size_hint)
+    inline size_t compiled_template::static_size() const
+    {
+        return static_size_;
+    }
+
+    // size of the last output rendered, 0 until the first render
+    inline size_t compiled_template::size_hint() const
+    {
+        return size_hint_.load(std::memory_order_relaxed);
+    }
+
+    inline void compiled_template::learn_size(size_t size) const
+    {
+        size_hint_.store(size, std::memory_order_relaxed);
+    }
+}
+
+#endif // COMPILED_TEMPLATE_H
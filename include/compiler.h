@@ -4,15 +4,25 @@
 #include "types.h"
 #include "error.h"
 #include "context.h"
+#include "compiled_template.h"
+#include "sink.h"
+#include "gather.h"
 
 #include <vector>
 #include <string>
+#include <utility>
 #include <functional>
-#include <unordered_map>
 
 namespace amps
 {
-    class parser_iterator;
+    // the operators of the language applied to known values, nullopt
+    // when the operator can't be used with them. Nothing is reported
+    // here, so the optimizer can use them to fold constants and leave
+    // anything that would fail to the render.
+    // and/or aren't binary operators here, they short-circuit with
+    // JUMP_FALSE/JUMP_TRUE and never reach a BINARY
+    object apply_binary(token_types oper, const object_t &a, const object_t &b);
+    object apply_unary(token_types oper, const object_t &value);
 
     struct branch
     {
@@ -20,62 +30,107 @@ namespace amps
         bool taken;
     };
 
-    struct block_cache
+    // current and end position of a running key, value loop
+    using pairs_cursor = std::variant<
+        std::pair<m_number::const_iterator, m_number::const_iterator>,
+        std::pair<m_string::const_iterator, m_string::const_iterator>>;
+
+    // a running loop: what it iterates, where it is and where its body
+    // starts, the loop variables are bound to the current item. A range
+    // is never materialized, its item is start + cursor * step
+    struct loop_frame
     {
-        size_t start;
+        const loop *info;
+        const user_var *collection;
+        int64_t start;
+        int64_t step;
+        pairs_cursor pairs;
+        size_t cursor;
         size_t end;
-        size_t resume;
-        size_t iterations;
+        size_t body;
+    };
+
+    // everything a single render changes lives here, so the compiler
+    // and the compiled template it runs remain untouched and can be
+    // shared by concurrent renders. When rendering to a sink, result
+    // only buffers the current chunk, written counts what the sink
+    // already received. When gathering, result is the arena of the
+    // output and pending is where its text not in a segment yet starts.
+    // frame is where the branches of the running template start, the
+    // ones below belong to the templates inserting it
+    struct render_state
+    {
+        context ctx;
+        std::string result;
+        std::vector<branch> branches;
+        std::vector<loop_frame> loops;
+        size_t frame;
+        sink *out;
+        gather_output *gather;
+        size_t written;
+        size_t pending;
+        bool broken;
     };
 
     class compiler
     {
-        bool running_cache_;
-        bool update_main_cache_;
-        std::string result_;
         error &error_;
-        size_t current_cache_;
-        context context_;
-        std::vector<branch> branches_;
-        std::unordered_map<size_t, block_cache> cache_;
         std::function<void(const context &,
                            const std::vector<branch> &)> inspect_;
 
     private:
-        void jump_to(token_types type);
-
-        bool parse_expression(parser_iterator &it);
-        bool parse_logical(parser_iterator &it);
-        bool parse_equality(parser_iterator &it);
-        bool parse_comparison(parser_iterator &it);
-        bool parse_addition(parser_iterator &it);
-        bool parse_multiplication(parser_iterator &it);
-        bool parse_unary(parser_iterator &it);
-        bool parse_primary(parser_iterator &it);
-
-        bool run_statement(parser_iterator &it, metainfo &metainfo);
-        bool run_print(parser_iterator &it);
-        bool run_for(parser_iterator &it);
-        bool run_endfor(parser_iterator &it);
-        bool run_if(parser_iterator &it);
-        bool run_else(parser_iterator &it);
-        bool run_elif(parser_iterator &it);
-        bool run_endif(parser_iterator &it);
-        bool run_insert(parser_iterator &it, metainfo &metainfo);
-
-        object compute(token_types oper, size_t line);
-        object compute_unary(token_types oper, size_t line);
-        object compute_numbers(number_t a,
-                               number_t b,
-                               token_types oper, size_t line);
-        object compute_strings(std::string a,
-                               std::string b,
-                               token_types oper);
+        void run(const compiled_template &tpl,
+                 const user_map &usermap,
+                 render_state &state) const;
+        void execute(const compiled_template &tpl, render_state &state) const;
+        void flush(render_state &state) const;
+        void write_out(std::string_view data, render_state &state) const;
+        void write_static(std::string_view text, render_state &state) const;
+        void cut_segment(render_state &state) const;
+        void recover(token_types statement,
+                     size_t line,
+                     render_state &state) const;
+
+        bool run_load_index(size_t id,
+                            size_t line,
+                            render_state &state) const;
+        bool run_jump(const instruction &ins, render_state &state) const;
+        bool run_size(render_state &state) const;
+        bool run_output(size_t line, render_state &state) const;
+        bool run_test(render_state &state) const;
+        bool run_else(size_t line, render_state &state) const;
+        bool run_elif(size_t line, render_state &state) const;
+        bool run_endif(size_t line, render_state &state) const;
+        bool run_loop_range(const program &prog,
+                            const instruction &ins,
+                            render_state &state) const;
+        bool run_loop_each(const program &prog,
+                           const instruction &ins,
+                           render_state &state) const;
+        bool run_loop_pairs(const program &prog,
+                            const instruction &ins,
+                            render_state &state) const;
+        bool run_endfor(size_t line, render_state &state) const;
+        void bind_item(const loop_frame &frame, render_state &state) const;
+        bool run_include(const insert_link &link,
+                         const std::string &filename,
+                         size_t line,
+                         render_state &state) const;
+
+        object compute(token_types oper, size_t line, context &ctx) const;
+        object compute_unary(token_types oper, size_t line, context &ctx) const;
 
     public:
         compiler(error &err);
-        std::string generate(metainfo &metainfo, const user_map &usermap);
-        void reset();
+        std::string generate(const compiled_template &tpl,
+                             const user_map &usermap) const;
+        // false when the render stopped before the end of the template
+        bool generate(const compiled_template &tpl,
+                      const user_map &usermap,
+                      sink &out) const;
+        bool generate(const compiled_template &tpl,
+                      const user_map &usermap,
+                      gather_output &out) const;
 
         template <typename F>
         void set_callback(F&& callback)
@@ -83,82 +138,6 @@ namespace amps
             inspect_ = std::forward<F>(callback);
         }
     };
-
-    class parser_iterator
-    {
-        friend class compiler;
-
-        const tokens &tokens_;
-        const metarange &range_;
-        size_t cursor_;
-
-        parser_iterator(const tokens &tks, const metarange &range) :
-            tokens_(tks),
-            range_(range),
-            cursor_(0)
-        {
-        }
-
-        bool advance()
-        {
-            if (cursor_ > tokens_.size() - 1) {
-                return false;
-            }
-
-            ++cursor_;
-            return true;
-        }
-
-        bool is_eot() const
-        {
-            if (cursor_ >= tokens_.size()) {
-                return true;
-            }
-
-            return false;
-        }
-
-        token_t look() const
-        {
-            return tokens_[cursor_];
-        }
-
-        token_t look_back() const
-        {
-            return tokens_[cursor_ - 1];
-        }
-
-        void next()
-        {
-            if (is_eot()) {
-                return;
-            }
-
-            advance();
-        }
-
-        void skip_all()
-        {
-            while (!is_eot()) {
-                advance();
-            }
-        }
-
-        metarange range() const
-        {
-            return range_;
-        }
-
-        bool match(token_types type)
-        {
-            if (!is_eot() && tokens_[cursor_].type() == type) {
-                advance();
-                return true;
-            }
-
-            return false;
-        }
-    };
 }
 
 #endif // COMPILER_H
@@ -5,6 +5,9 @@ constexpr size_t MAX_STRING_LEN = 256;
 constexpr size_t MAX_VAR_LEN = 32;
 constexpr size_t MAX_READ_SZ = 4096;
 constexpr size_t MAX_ITERATION = 100;
+constexpr size_t OUTPUT_CHUNK_SZ = 16384;
+constexpr size_t MIN_SEGMENT_SZ = 64;
+constexpr size_t STACK_INLINE_SZ = 16;
 constexpr char TAG_OPEN = '{';
 constexpr char TAG_ECHO = '=';
 constexpr char TAG_CODE = '%';
@@ -4,17 +4,55 @@
 #include "stack.h"
 #include "types.h"
 
+#include <vector>
+#include <variant>
+
 namespace amps
 {
+    using v_number = std::vector<number_t>;
+    using v_string = std::vector<std::string>;
+    using m_number = std::unordered_map<std::string, number_t>;
+    using m_string = std::unordered_map<std::string, std::string>;
+
+    // what a variable is bound to: nothing (undefined), a whole user
+    // variable, a string owned by someone else (an item of a user
+    // collection) or a number stored inline. Loop variables bind to
+    // the current item by reference, they never copy it
+    using binding = std::variant<std::monostate,
+                                 const user_var*,
+                                 const std::string*,
+                                 number_t>;
+
+    bool binding_equals(const binding &bind, const user_var &data);
+
+    // identifiers are resolved to slots when the template is compiled,
+    // the slots of the template being executed are bound to the
+    // environment once and every access after that is a plain index.
+    //
+    // The user data is borrowed, never copied: it must outlive the
+    // render and it's only read. Variables created by the template
+    // (loop variables and their bookkeeping) live in a small overlay
+    // that shadows the user data. Slots copy the binding they resolve
+    // to, locals_ points to the overlay entry (unordered_map never
+    // moves its elements) of the slots the template defined, so both
+    // are updated without hashing the name again
     class context
     {
-        user_map environment_;
+        const user_map *environment_;
+        std::unordered_map<std::string, binding> overlay_;
         gstack stack_;
         size_t counter_;
+        const std::vector<std::string> *names_;
+        std::vector<binding> slots_;
+        std::vector<binding*> locals_;
+
+        binding environment_find(const std::string &key) const;
 
     public:
         context() :
-            counter_(0)
+            environment_(nullptr),
+            counter_(0),
+            names_(nullptr)
         {
         }
 
@@ -39,45 +77,50 @@ namespace amps
         vobject_types stack_top_type() const;
         std::string stack_pop_string_or(const std::string &opt);
         number_t stack_pop_number_or(number_t opt);
-        object stack_top() const;
+        const object &stack_top() const;
         object stack_pop();
         bool stack_empty() const;
         bool stack_pop_bool_or(bool opt);
         bool stack_pop_resolve_bool();
-        void stack_push(const object_t &obj);
+        void stack_push(object_t &&obj);
+        template <typename... Args>
+        void stack_emplace(Args&&... args);
+        void stack_reserve(size_t depth);
         void stack_clear();
-        bool stack_push_from_environment(const std::string &key);
-        bool stack_push_from_environment(const std::string &key,
-                size_t index);
-        bool stack_push_from_environment(const std::string &key,
-                const std::string &user_key);
+        bool stack_push_from_slot(size_t slot);
+        bool stack_push_from_slot(size_t slot, size_t index);
+        bool stack_push_from_slot(size_t slot, const std::string &user_key);
 
         // --------------------------
         // handles the env. table
         // --------------------------
         bool environment_is_key_defined(const std::string &key) const;
         void environment_setup(const user_map &data);
-        void environment_add_or_update(const std::string &key,
-                const user_var &data);
-        void environment_add_or_update(const std::string &key,
-                const std::string &dest_key,
-                size_t index);
-        void environment_erase(const std::string &key);
+        void environment_bind(const std::vector<std::string> &names);
         size_t environment_get_size(const std::string &key) const;
-        size_t environment_add_or_update(const std::string &key,
-                const std::string &dest_key,
-                const std::string &value,
-                size_t index);
         bool environment_check_value(const std::string &key,
                 const user_var &data) const;
-        void environment_increment_value(const std::string &key);
+
+        // --------------------------
+        // handles the bound slots
+        // --------------------------
+        bool slot_is_defined(size_t slot) const;
+        const std::string &slot_name(size_t slot) const;
+        const user_var *slot_get_variable(size_t slot) const;
+        void slot_set(size_t slot, const binding &bind);
+        void slot_erase(size_t slot);
+        size_t slot_get_size(size_t slot) const;
     };
 
     inline void context::reset()
     {
         counter_ = 0;
-        environment_.clear();
+        environment_ = nullptr;
+        overlay_.clear();
         stack_.clear();
+        names_ = nullptr;
+        slots_.clear();
+        locals_.clear();
     }
 
     inline void context::jump_to(size_t n)
@@ -90,17 +133,22 @@ namespace amps
         return counter_;
     }
 
+    // nothing takes an object as an operand, an empty stack is typed
+    // as one so any type check on it fails
     inline vobject_types context::stack_top_type() const
     {
-        return stack_.look_back().value().get_type();
+        const object &top = stack_.look_back();
+        if (top == std::nullopt) {
+            return vobject_types::OBJECT;
+        }
+
+        return top->get_type();
     }
 
-    inline object context::stack_top() const
+    // the value on top, an empty object when there's none. It's only
+    // valid until the stack changes
+    inline const object &context::stack_top() const
     {
-        if (stack_.empty()) {
-            return std::nullopt;
-        }
-
         return stack_.look_back();
     }
 
@@ -114,9 +162,20 @@ namespace amps
         return stack_.pop();
     }
 
-    inline void context::stack_push(const object_t &obj)
+    inline void context::stack_push(object_t &&obj)
     {
-        stack_.push(obj);
+        stack_.push(std::move(obj));
+    }
+
+    template <typename... Args>
+    inline void context::stack_emplace(Args&&... args)
+    {
+        stack_.emplace(std::forward<Args>(args)...);
+    }
+
+    inline void context::stack_reserve(size_t depth)
+    {
+        stack_.reserve(depth);
     }
 
     inline void context::stack_clear()
@@ -161,38 +220,70 @@ namespace amps
             return false;
         }
 
-        if (result.value().get_type() == vobject_types::BOOL) {
-            return result.value().get_bool_or(false);
+        return result.value().is_true();
+    }
+
+    inline void context::environment_setup(const user_map &data)
+    {
+        environment_ = &data;
+        overlay_.clear();
+    }
+
+    inline bool context::environment_is_key_defined(const std::string &key) const
+    {
+        return !std::holds_alternative<std::monostate>(environment_find(key));
+    }
+
+    inline binding context::environment_find(const std::string &key) const
+    {
+        auto it = overlay_.find(key);
+        if (it != overlay_.end()) {
+            return it->second;
         }
-        else if (result.value().get_type() == vobject_types::NUMBER) {
-            if (result.value().get_number_or(0) == 0) {
-                return false;
-            }
+
+        if (environment_ == nullptr) {
+            return std::monostate();
         }
-        else if (result.value().get_type() == vobject_types::STRING) {
-            if (result.value().get_string_or("").size() == 0) {
-                return false;
-            }
+
+        auto user = environment_->find(key);
+        if (user != environment_->end()) {
+            return &user->second;
         }
 
-        return true;
+        return std::monostate();
     }
 
-    inline void context::environment_setup(const user_map &data)
+    inline bool context::slot_is_defined(size_t slot) const
     {
-        environment_ = data;
+        return !std::holds_alternative<std::monostate>(slots_[slot]);
     }
 
-    inline bool context::environment_is_key_defined(const std::string &key) const
+    inline const user_var *context::slot_get_variable(size_t slot) const
     {
-        return environment_.find(key) != environment_.end();
+        auto var = std::get_if<const user_var*>(&slots_[slot]);
+        if (var == nullptr) {
+            return nullptr;
+        }
+
+        return *var;
     }
 
-    inline void context::environment_erase(const std::string &key)
+    inline void context::slot_set(size_t slot, const binding &bind)
     {
-        if (environment_is_key_defined(key)) {
-            environment_.erase(environment_.find(key));
+        slots_[slot] = bind;
+
+        if (locals_[slot] != nullptr) {
+            *locals_[slot] = bind;
+            return;
         }
+
+        auto it = overlay_.insert_or_assign(slot_name(slot), bind).first;
+        locals_[slot] = &it->second;
+    }
+
+    inline const std::string &context::slot_name(size_t slot) const
+    {
+        return (*names_)[slot];
     }
 }
 
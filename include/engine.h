@@ -6,6 +6,8 @@
 #include "error.h"
 
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace amps
 {
@@ -17,15 +19,76 @@ namespace amps
 
         scan scanner_;
         compiler compiler_;
+        template_ptr template_;
+        bool optimize_;
+
+        // every prepared template by name and, for each file any of them
+        // was built from, the names of the templates using it
+        std::unordered_map<std::string, template_ptr> templates_;
+        std::unordered_map<std::string,
+                           std::unordered_set<std::string>> dependents_;
+
+        // inotify descriptor and the directories it watches
+        int watch_fd_;
+        std::unordered_map<int, std::string> watches_;
+
+    private:
+        template_ptr load_template(const std::string &name);
+        void track(const std::string &name, const compiled_template &tpl);
+        void watch_directory(const std::string &dir);
 
     public:
         engine(error &err);
         ~engine();
 
         void set_template_directory(const std::string &path);
+
+        // templates prepared from now on are optimized: literal
+        // expressions are computed and dead branches dropped once,
+        // when the template is compiled
+        void set_optimize(bool optimize);
         void prepare_template(const std::string &name);
         bool compile(const user_map &um);
-        std::string render(const user_map &um);
+
+        // hot reload: once watching, refresh recompiles the prepared
+        // templates whose own file or any inserted file changed since
+        // the last call and returns how many were recompiled. It only
+        // works on Linux, watch returns false anywhere else.
+        // Like prepare_template, refresh must not run concurrently
+        // with render
+        bool watch();
+        size_t refresh();
+
+        // render is const: once a template is prepared, any number of
+        // threads can render it at the same time. prepare_template must
+        // not run concurrently with render though
+        std::string render(const user_map &um) const;
+        std::string render(const std::string &name,
+                           const user_map &um) const;
+        std::string render(const compiled_template &tpl,
+                           const user_map &um) const;
+
+        // the same renders streamed to a sink while they run, false
+        // when there's no template or the sink stopped accepting the
+        // output
+        bool render(const user_map &um, sink &out) const;
+        bool render(const std::string &name,
+                    const user_map &um,
+                    sink &out) const;
+        bool render(const compiled_template &tpl,
+                    const user_map &um,
+                    sink &out) const;
+
+        // the same renders as a list of segments, most of them pointing
+        // to the text of the template (see gather_output), the output
+        // keeps the template alive. False when there's no template or
+        // the render didn't complete
+        bool render(const user_map &um, gather_output &out) const;
+        bool render(const std::string &name,
+                    const user_map &um,
+                    gather_output &out) const;
+        template_ptr get_template() const;
+        template_ptr get_template(const std::string &name) const;
 
         /*
         const error &get_error() const
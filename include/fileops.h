@@ -3,10 +3,20 @@
 
 #include "config.h"
 
+#include <cstdint>
 #include <fstream>
+#include <filesystem>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace amps
 {
 
@@ -82,6 +92,153 @@ namespace amps
         return content;
     }
 
+    // the same file always gets the same name, whatever path was used
+    // to reach it. The file doesn't need to exist
+    inline std::string canonical_path(const std::string &path)
+    {
+        std::error_code err;
+        auto canonical = std::filesystem::weakly_canonical(path, err);
+        if (err) {
+            return path;
+        }
+
+        return canonical.string();
+    }
+
+    // what a file looked like at some point, size and modification time
+    // in nanoseconds (seconds outside Linux). A missing file has a size
+    // of -1, so it changes when the file shows up
+    struct file_stamp
+    {
+        int64_t size;
+        int64_t mtime;
+
+        bool operator==(const file_stamp &other) const
+        {
+            return size == other.size && mtime == other.mtime;
+        }
+
+        bool operator!=(const file_stamp &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    inline file_stamp stamp_file(const std::string &name)
+    {
+        struct stat buffer;
+        if (stat(name.c_str(), &buffer) != 0) {
+            return file_stamp{-1, 0};
+        }
+
+#ifdef __linux__
+        int64_t mtime = static_cast<int64_t>(buffer.st_mtim.tv_sec) * 1000000000 +
+                        buffer.st_mtim.tv_nsec;
+#else
+        int64_t mtime = static_cast<int64_t>(buffer.st_mtime);
+#endif
+        return file_stamp{static_cast<int64_t>(buffer.st_size), mtime};
+    }
+
+    // content of a template file, a snapshot taken when it's loaded.
+    // Compiled templates keep slices of it for as long as they live,
+    // so it's never a view of the file itself: the file can be edited,
+    // truncated or removed while templates built from it are rendered.
+    // That's why it isn't mapped: even a private mapping shows the
+    // writes made to the file before a page is first touched, and a
+    // truncated file raises SIGBUS on the pages past its new end. The
+    // file is read once, straight into a buffer of its size
+    class file_content
+    {
+        std::string path_;
+        std::string buffer_;
+
+    public:
+        file_content()                               = default;
+        ~file_content()                              = default;
+
+        file_content(const file_content&)            = delete;
+        file_content(file_content&&)                 = delete;
+        file_content &operator=(const file_content&) = delete;
+        file_content &operator=(file_content&&)      = delete;
+
+        const std::string &path() const;
+        std::string_view view() const;
+
+        friend std::shared_ptr<const file_content>
+        load_file(const std::string &filename);
+    };
+
+    // canonical path of the file the content was read from
+    inline const std::string &file_content::path() const
+    {
+        return path_;
+    }
+
+    inline std::string_view file_content::view() const
+    {
+        return buffer_;
+    }
+
+    // nullptr if the file can't be opened or isn't a regular file
+    inline std::shared_ptr<const file_content>
+    load_file(const std::string &filename)
+    {
+        auto content = std::make_shared<file_content>();
+
+#ifdef __linux__
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat buffer;
+        if (fstat(fd, &buffer) != 0 || !S_ISREG(buffer.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+
+        // read at once into a buffer of the right size, the file may
+        // shrink while it's read, what was read is all there is
+        size_t size = static_cast<size_t>(buffer.st_size);
+        content->buffer_.resize(size);
+        size_t total = 0;
+        while (total < size) {
+            ssize_t len = read(fd, &content->buffer_[total], size - total);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (len <= 0) {
+                break;
+            }
+            total += static_cast<size_t>(len);
+        }
+        content->buffer_.resize(total);
+        close(fd);
+#else
+        auto file = check_file(filename);
+        if (!file.is_file || !file.is_readable) {
+            return nullptr;
+        }
+
+        std::ifstream input(filename, std::ios::binary);
+        if (!input.is_open()) {
+            return nullptr;
+        }
+
+        content->buffer_.assign((std::istreambuf_iterator<char>(input)),
+                                 std::istreambuf_iterator<char>());
+#endif
+        content->path_ = canonical_path(filename);
+        return content;
+    }
+
+    inline std::string parent_path(const std::string &path)
+    {
+        return std::filesystem::path(path).parent_path().string();
+    }
+
     inline std::string append(const std::string &path,
                               const std::string &file)
     {
@@ -0,0 +1,169 @@
+#ifndef GATHER_H
+#define GATHER_H
+
+#include "compiled_template.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <string_view>
+
+#ifdef __linux__
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+namespace amps
+{
+#ifdef __linux__
+    using segment = iovec;
+#else
+    struct segment
+    {
+        void *iov_base;
+        size_t iov_len;
+    };
+#endif
+
+    // a render kept as a list of segments instead of a single string.
+    // The text of the template isn't copied, its segments point to the
+    // compiled template (and to the templates it inserts), only what
+    // the template computes is written to a small arena of its own.
+    // The segments are valid as long as the output and the template
+    // are: the engine keeps the template it rendered alive, a caller
+    // rendering a compiled template directly must keep it itself
+    class gather_output
+    {
+        friend class compiler;
+
+        template_ptr owner_;
+        std::string arena_;
+        std::vector<segment> segments_;
+        size_t size_;
+
+    private:
+        // the arena can still grow while rendering, its segments get
+        // their address when the render is done
+        void add(const char *data, size_t size);
+        void finish(std::string &&arena);
+
+    public:
+        gather_output() :
+            size_(0)
+        {
+        }
+
+        ~gather_output()                                = default;
+
+        gather_output(const gather_output&)             = delete;
+        gather_output(gather_output&&)                  = delete;
+        gather_output &operator=(const gather_output&)  = delete;
+        gather_output &operator=(gather_output&&)       = delete;
+
+        void clear();
+        void keep_alive(template_ptr tpl);
+
+        const std::vector<segment> &segments() const;
+        size_t size() const;
+        std::string str() const;
+        bool write_to(int fd) const;
+    };
+
+    inline void gather_output::add(const char *data, size_t size)
+    {
+        segments_.push_back(segment{const_cast<char*>(data), size});
+        size_ += size;
+    }
+
+    inline void gather_output::finish(std::string &&arena)
+    {
+        arena_ = std::move(arena);
+
+        size_t offset = 0;
+        for (auto &seg : segments_) {
+            if (seg.iov_base == nullptr) {
+                seg.iov_base = arena_.data() + offset;
+                offset += seg.iov_len;
+            }
+        }
+    }
+
+    inline void gather_output::clear()
+    {
+        owner_.reset();
+        arena_.clear();
+        segments_.clear();
+        size_ = 0;
+    }
+
+    inline void gather_output::keep_alive(template_ptr tpl)
+    {
+        owner_ = std::move(tpl);
+    }
+
+    inline const std::vector<segment> &gather_output::segments() const
+    {
+        return segments_;
+    }
+
+    inline size_t gather_output::size() const
+    {
+        return size_;
+    }
+
+    inline std::string gather_output::str() const
+    {
+        std::string result;
+        result.reserve(size_);
+        for (const auto &seg : segments_) {
+            result.append(static_cast<const char*>(seg.iov_base), seg.iov_len);
+        }
+
+        return result;
+    }
+
+    // writes every segment with writev, without joining them first.
+    // Only available on Linux, it fails to write anywhere else
+    inline bool gather_output::write_to(int fd) const
+    {
+#ifdef __linux__
+        std::vector<segment> pending(segments_);
+        size_t first = 0;
+
+        while (first < pending.size()) {
+            int count = static_cast<int>(std::min<size_t>(pending.size() - first,
+                                                          IOV_MAX));
+            ssize_t sent = writev(fd, pending.data() + first, count);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (sent <= 0) {
+                return false;
+            }
+
+            // skip what was written, a segment can be written partially
+            size_t left = static_cast<size_t>(sent);
+            while (first < pending.size() && left >= pending[first].iov_len) {
+                left -= pending[first].iov_len;
+                ++first;
+            }
+
+            if (left > 0) {
+                pending[first].iov_base =
+                    static_cast<char*>(pending[first].iov_base) + left;
+                pending[first].iov_len -= left;
+            }
+        }
+
+        return true;
+#else
+        (void)fd;
+        return false;
+#endif
+    }
+}
+
+#endif // GATHER_H
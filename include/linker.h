@@ -0,0 +1,109 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include "error.h"
+#include "fileops.h"
+#include "compiled_template.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+
+namespace amps
+{
+    // the inserted templates compiled so far, by canonical path. A file
+    // inserted by many templates is scanned and compiled once and shared
+    // by all of them, however many times they're linked. A unit is only
+    // found while the files it was built from (its own and the ones it
+    // inserts, directly or not) look the same as when they were read,
+    // invalidate drops the units built from a file right away
+    class unit_cache
+    {
+        struct entry
+        {
+            std::shared_ptr<compiled_template> unit;
+            bool optimized;
+            std::vector<std::pair<std::string, file_stamp>> files;
+        };
+
+        std::unordered_map<std::string, entry> units_;
+
+    public:
+        unit_cache()                                = default;
+        ~unit_cache()                               = default;
+
+        unit_cache(const unit_cache&)               = delete;
+        unit_cache(unit_cache&&)                    = delete;
+        unit_cache &operator=(const unit_cache&)    = delete;
+        unit_cache &operator=(unit_cache&&)         = delete;
+
+        std::shared_ptr<compiled_template>
+        find(const std::string &path,
+             bool optimized,
+             std::vector<std::pair<std::string, file_stamp>> &files);
+        void add(const std::string &path,
+                 std::shared_ptr<compiled_template> unit,
+                 bool optimized,
+                 std::vector<std::pair<std::string, file_stamp>> &&files);
+        void invalidate(const std::string &path);
+        void clear();
+        size_t size() const;
+    };
+
+    // resolves the insert statements of a template when it's compiled,
+    // so rendering never reads, scans or assembles a file. Every file is
+    // compiled once and shared, through the unit cache, by all the
+    // templates inserting it. An insert that would reach a file already
+    // being inserted up in the chain is a cycle, it's cut and left
+    // unresolved. A unit cut by a cycle depends on the chain that reached
+    // it, it's never cached.
+    // When asked to, every template is optimized before its inserts
+    // are resolved, so the inserts left in code never run aren't read
+    class linker
+    {
+        error &error_;
+        bool optimize_;
+        unit_cache local_;
+        unit_cache &units_;
+        std::vector<std::string> chain_;
+        std::unordered_map<std::string, file_stamp> stamps_;
+
+    private:
+        bool link_unit(compiled_template &tpl, const std::string &path);
+        insert_link resolve(const std::string &filename, bool &complete);
+        void add_dependency(compiled_template &tpl,
+                            const std::string &filename);
+
+    public:
+        // without a cache of its own, files are only shared by the
+        // templates a single link reaches
+        linker(error &err, bool optimize = false) :
+            error_(err),
+            optimize_(optimize),
+            units_(local_)
+        {
+        }
+
+        linker(error &err, unit_cache &units, bool optimize = false) :
+            error_(err),
+            optimize_(optimize),
+            units_(units)
+        {
+        }
+
+        ~linker()                         = default;
+
+        linker(const linker&)             = delete;
+        linker(linker&&)                  = delete;
+        linker &operator=(const linker&)  = delete;
+        linker &operator=(linker&&)       = delete;
+
+        // path is the canonical path of the template file, empty when
+        // the template wasn't read from a file
+        void link(compiled_template &tpl, const std::string &path = "");
+    };
+}
+
+#endif // LINKER_H
@@ -1,8 +1,12 @@
 #ifndef METADATA_H
 #define METADATA_H
 
+#include <list>
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <string_view>
 
 #include "token.h"
 
@@ -23,12 +27,23 @@ namespace amps
         size_t line;
     };
 
+    // 64-bit FNV-1a of the template source. It depends on nothing but
+    // the content, so the same template always gets the same identity
+    inline uint64_t content_hash(std::string_view content)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (unsigned char c : content) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
     struct metadata
     {
-        size_t hash_tokens;
         metatype type;
         metarange range;
-        std::string data;
+        std::string_view data;
         std::vector<token_t> tokens;
 
         void add_token(const token_t &tk);
@@ -37,26 +52,34 @@ namespace amps
     inline void metadata::add_token(const token_t &tk)
     {
         tokens.emplace_back(tk);
-        hash_tokens += tk.hash();
     }
 
     class metainfo
     {
-        size_t hash_metadata;
+        uint64_t hash_;
+        std::shared_ptr<const void> owner_;
+        std::string_view source_;
         std::vector<metadata> metadata_;
+        std::list<std::string> joined_;
 
     public:
         typedef metadata value_type;
         typedef std::vector<metadata>::difference_type difference_type;
 
         metainfo() :
-            hash_metadata(0)
+            hash_(0)
         {
         }
 
         void add_metadata(const metadata &data);
-        size_t hash() const;
-        void rehash();
+        void add_metadata(metadata &&data);
+        uint64_t hash() const;
+        void set_hash(uint64_t hash);
+        void set_source(std::shared_ptr<const void> owner,
+                        std::string_view content);
+        std::string_view source() const;
+        std::string_view join(std::string_view first,
+                              std::string_view second);
 
         void push_back(const metadata &data);
         metadata &back();
@@ -73,11 +96,39 @@ namespace amps
         std::vector<metadata>::const_iterator end() const noexcept;
     };
 
-    inline void metainfo::rehash()
+    inline void metainfo::set_hash(uint64_t hash)
     {
-        for (const auto &tk : metadata_) {
-            hash_metadata += tk.hash_tokens;
+        hash_ = hash;
+    }
+
+    // the data of every metadata is a slice of the template content,
+    // the metainfo shares the ownership of whatever holds it (a string
+    // or a loaded file), so the slices survive when it's moved
+    inline void metainfo::set_source(std::shared_ptr<const void> owner,
+                                     std::string_view content)
+    {
+        owner_ = std::move(owner);
+        source_ = content;
+    }
+
+    inline std::string_view metainfo::source() const
+    {
+        return source_;
+    }
+
+    // text that isn't contiguous in the source (blank text was dropped
+    // in between) can't be a single slice of it, the metainfo keeps the
+    // joined copy. Joining onto the last copy extends it in place, the
+    // nodes of the list never move so the views stay valid
+    inline std::string_view metainfo::join(std::string_view first,
+                                           std::string_view second)
+    {
+        if (joined_.size() == 0 || joined_.back().data() != first.data()) {
+            joined_.emplace_back(first);
         }
+
+        joined_.back().append(second);
+        return joined_.back();
     }
 
     inline void metainfo::remove(size_t idx)
@@ -89,9 +140,9 @@ namespace amps
         metadata_.erase(metadata_.begin() + idx);
     }
 
-    inline size_t metainfo::hash() const
+    inline uint64_t metainfo::hash() const
     {
-        return hash_metadata;
+        return hash_;
     }
 
     inline void metainfo::push_back(const metadata &data)
@@ -148,12 +199,20 @@ namespace amps
     inline void metainfo::clear()
     {
         metadata_.clear();
+        joined_.clear();
+        owner_.reset();
+        source_ = {};
+        hash_ = 0;
     }
 
     inline void metainfo::add_metadata(const metadata &data)
     {
         metadata_.emplace_back(data);
-        hash_metadata += data.hash_tokens;
+    }
+
+    inline void metainfo::add_metadata(metadata &&data)
+    {
+        metadata_.emplace_back(std::move(data));
     }
 }
 
@@ -2,6 +2,8 @@
 #define OBJECT_H
 
 #include <string>
+#include <charconv>
+#include <string_view>
 #include <variant>
 #include <iostream>
 
@@ -43,77 +45,227 @@ namespace amps
         return os;
     }
 
+    // the empty string values refer to when there's nothing to refer to
+    inline const std::string empty_string;
+
+    // a value of the stack, 16 bytes: numbers and booleans are stored
+    // inline, strings are referenced. A string coming from the template
+    // or from the user data is only pointed to, both outlive the render,
+    // a string built while rendering ("a" + "b") is owned by the value
+    // and it's the only case a value allocates. Values are moved, never
+    // copied by accident: clone is the only way to copy an owned string
     class vobject
     {
-        var_t data_;
+        // booleans are stored as the number 0 or 1
+        union {
+            number_t number_;
+            const std::string *string_;
+        };
         vobject_types ftype_;
+        bool owned_;
+
+        bool has_string() const;
+        void copy_from(const vobject &other);
+        void release();
 
     public:
-        vobject()
+        vobject() :
+            number_(0),
+            ftype_(vobject_types::BOOL),
+            owned_(false)
         {
         }
 
-        vobject(var_t value) :
-            data_(value)
+        vobject(bool value) :
+            number_(value ? 1 : 0),
+            ftype_(vobject_types::BOOL),
+            owned_(false)
+        {
+        }
+
+        vobject(number_t value) :
+            number_(value),
+            ftype_(vobject_types::NUMBER),
+            owned_(false)
+        {
+        }
+
+        // refers to the string, it must outlive the value
+        vobject(const std::string &value) :
+            string_(&value),
+            ftype_(vobject_types::STRING),
+            owned_(false)
+        {
+        }
+
+        vobject(std::string &&value) :
+            string_(new std::string(std::move(value))),
+            ftype_(vobject_types::STRING),
+            owned_(true)
         {
-            if (std::holds_alternative<std::string>(data_)) {
-                ftype_ = vobject_types::STRING;
-            }
-            else if (std::holds_alternative<number_t>(data_)) {
-                ftype_ = vobject_types::NUMBER;
-            }
-            else {
-                ftype_ = vobject_types::BOOL;
-            }
         }
 
-        vobject(var_t value, vobject_types forced_type) :
-            data_(value), ftype_(forced_type)
+        vobject(const std::string &value, vobject_types forced_type) :
+            string_(&value),
+            ftype_(forced_type),
+            owned_(false)
         {
         }
 
-        vobject(vobject &&)                 = default;
-        vobject(const vobject &)            = default;
-        ~vobject()                          = default;
+        vobject(const char *)               = delete;
+
+        vobject(vobject &&other);
+        vobject(const vobject &other)               = delete;
+        ~vobject();
+
+        vobject &operator=(const vobject &other)    = delete;
+        vobject &operator=(vobject &&other);
 
-        vobject &operator=(const vobject &) = default;
-        vobject &operator=(vobject &&)      = default;
+        vobject clone() const;
 
         vobject_types get_type() const;
         bool get_bool_or(bool alt) const;
         number_t get_number_or(number_t alt) const;
+        bool is_true() const;
         std::string get_string_or(const std::string &alt) const;
+        std::string_view get_view_or(std::string_view alt) const;
+        const std::string &get_ref_or(const std::string &alt) const;
         std::string to_string() const;
+        void print(std::string &out) const;
     };
 
+    static_assert(sizeof(vobject) == 16, "vobject must stay 16 bytes");
+
+    inline vobject::vobject(vobject &&other) :
+        number_(0),
+        ftype_(vobject_types::BOOL),
+        owned_(false)
+    {
+        *this = std::move(other);
+    }
+
+    inline vobject vobject::clone() const
+    {
+        vobject copy;
+        copy.copy_from(*this);
+        return copy;
+    }
+
+    inline bool vobject::has_string() const
+    {
+        return ftype_ == vobject_types::STRING || ftype_ == vobject_types::OBJECT;
+    }
+
+    inline void vobject::copy_from(const vobject &other)
+    {
+        ftype_ = other.ftype_;
+        owned_ = other.owned_;
+
+        if (!other.has_string()) {
+            number_ = other.number_;
+        }
+        else if (owned_) {
+            string_ = new std::string(*other.string_);
+        }
+        else {
+            string_ = other.string_;
+        }
+    }
+
+    inline vobject::~vobject()
+    {
+        release();
+    }
+
+    inline void vobject::release()
+    {
+        if (owned_) {
+            delete string_;
+            owned_ = false;
+        }
+    }
+
+    inline vobject &vobject::operator=(vobject &&other)
+    {
+        if (this != &other) {
+            release();
+            ftype_ = other.ftype_;
+            owned_ = other.owned_;
+
+            if (has_string()) {
+                string_ = other.string_;
+            }
+            else {
+                number_ = other.number_;
+            }
+            other.owned_ = false;
+        }
+
+        return *this;
+    }
+
     inline bool vobject::get_bool_or(bool alt) const
     {
-        auto ret = std::get_if<bool>(&data_);
-        if (ret == nullptr) {
+        if (ftype_ != vobject_types::BOOL) {
             return alt;
         }
 
-        return *ret;
+        return number_ != 0;
     }
 
     inline number_t vobject::get_number_or(number_t alt) const
     {
-        auto ret = std::get_if<number_t>(&data_);
-        if (ret == nullptr) {
+        if (ftype_ != vobject_types::NUMBER) {
             return alt;
         }
 
-        return *ret;
+        return number_;
     }
 
     inline std::string vobject::get_string_or(const std::string &alt) const
     {
-        auto ret = std::get_if<std::string>(&data_);
-        if (ret == nullptr) {
+        if (!has_string()) {
+            return alt;
+        }
+
+        return *string_;
+    }
+
+    // the string without copying it, valid as long as the value is
+    inline std::string_view vobject::get_view_or(std::string_view alt) const
+    {
+        if (!has_string()) {
             return alt;
         }
 
-        return *ret;
+        return *string_;
+    }
+
+    // the string itself, valid as long as the value is
+    inline const std::string &vobject::get_ref_or(const std::string &alt) const
+    {
+        if (!has_string()) {
+            return alt;
+        }
+
+        return *string_;
+    }
+
+    // how the value reads as a condition: false, 0 and "" are false,
+    // anything else is true
+    inline bool vobject::is_true() const
+    {
+        switch (get_type()) {
+            case vobject_types::BOOL:
+            case vobject_types::NUMBER:
+                return number_ != 0;
+
+            case vobject_types::STRING:
+                return string_->size() > 0;
+
+            default:
+                return true;
+        }
     }
 
     inline vobject_types vobject::get_type() const
@@ -121,6 +273,35 @@ namespace amps
         return ftype_;
     }
 
+    // appends the value the way a print shows it: strings as they are,
+    // numbers signed, written straight into the output without a
+    // temporary string
+    inline void vobject::print(std::string &out) const
+    {
+        switch (get_type()) {
+            case vobject_types::STRING:
+                out += *string_;
+                break;
+
+            case vobject_types::NUMBER: {
+                char digits[24];
+                auto end = std::to_chars(digits, digits + sizeof(digits),
+                                         static_cast<int64_t>(number_)).ptr;
+                out.append(digits, end - digits);
+                break;
+            }
+
+            case vobject_types::BOOL:
+                out += (number_ != 0) ? "true" : "false";
+                break;
+
+            // a collection has nothing to print
+            case vobject_types::OBJECT:
+                out += "false";
+                break;
+        }
+    }
+
     inline std::string vobject::to_string() const
     {
         switch (get_type()) {
@@ -0,0 +1,67 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "types.h"
+#include "object.h"
+#include "bytecode.h"
+#include "metadata.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace amps
+{
+    // rewrites a program once it's assembled, so whatever only depends
+    // on literals is computed once instead of on every render:
+    //   - operators applied to literals become the literal they result
+    //   - a condition made only of a literal keeps the clause it takes
+    //     and drops the ones that can never run
+    //   - a print of a literal becomes static text, merged with the
+    //     short text around it (long text stays a slice of the source)
+    // Anything that would fail (1 / 0, "a" + 1...) is left as it is,
+    // it's still reported when the template is rendered
+    class optimizer
+    {
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        program *program_;
+        std::unordered_map<std::string, size_t> strings_;
+        std::vector<bool> keep_;
+
+    private:
+        size_t intern(const std::string &str);
+        bool is_constant(const instruction &ins) const;
+        object_t constant(const instruction &ins) const;
+        instruction make_constant(const object_t &value, uint32_t line);
+        std::string constant_text(const object_t &value) const;
+
+        void fold_expressions();
+        void fold_prints();
+        void fold_branches();
+        void merge_text(const metainfo &info);
+
+        bool is_balanced(size_t from, size_t to) const;
+        bool clause_constant(size_t pc, bool &taken) const;
+        void remove(size_t from, size_t to);
+        void fold_chain(size_t pc);
+        void compact();
+
+    public:
+        optimizer() :
+            program_(nullptr)
+        {
+        }
+
+        ~optimizer()                              = default;
+
+        optimizer(const optimizer&)               = delete;
+        optimizer(optimizer&&)                    = delete;
+        optimizer &operator=(const optimizer&)    = delete;
+        optimizer &operator=(optimizer&&)         = delete;
+
+        void optimize(const metainfo &info, program &prog);
+    };
+}
+
+#endif // OPTIMIZER_H
@@ -3,9 +3,12 @@
 
 #include "error.h"
 #include "types.h"
+#include "compiled_template.h"
+#include "fileops.h"
+#include "linker.h"
 
-#include <unordered_map>
 #include <string>
+#include <string_view>
 
 namespace amps
 {
@@ -13,19 +16,19 @@ namespace amps
 
     class scan
     {
-        std::unordered_map<std::string, token_types> keywords_;
         metainfo metainfo_;
         std::string file_;
         uint16_t line_;
         error &error_;
+        unit_cache units_;
 
     private:
-        metadata code_block(const std::string &content,
+        metadata code_block(std::string_view content,
                             size_t &position);
-        metadata text_block(const std::string &content,
+        metadata text_block(std::string_view content,
                             size_t &position,
                             bool force);
-        void parse_block(const std::string &content);
+        void parse_block(std::string_view content);
 
         void scan_code(const scan_iterator &it, metadata &data);
         void parse_string(const scan_iterator &it, metadata &data);
@@ -42,23 +45,36 @@ namespace amps
         scan &operator=(vobject &&) = delete;
 
         void do_scan(const std::string &content);
+        void do_scan(const std::shared_ptr<const file_content> &file);
+        void do_scan(std::shared_ptr<const void> owner,
+                     std::string_view content);
         metainfo &get_metainfo();
+        template_ptr get_template(bool optimize = false);
+
+        // the files inserted by the templates this scanner compiled,
+        // shared by all of them
+        unit_cache &get_units();
     };
 
     inline metainfo &scan::get_metainfo()
     {
-        metainfo_.rehash();
         return metainfo_;
     }
 
+    inline unit_cache &scan::get_units()
+    {
+        return units_;
+    }
+
+
     class scan_iterator
     {
         friend class scan;
 
-        const std::string &data_;
+        std::string_view data_;
         mutable size_t cursor_;
 
-        scan_iterator(const std::string &data) :
+        scan_iterator(std::string_view data) :
             data_(data),
             cursor_(0)
         {
@@ -114,13 +130,13 @@ namespace amps
             return true;
         }
 
-        std::string substr(size_t start, size_t len) const
+        std::string_view substr(size_t start, size_t len) const
         {
             if (len == 0) {
                 len = data_.size();
             }
 
-            return std::string(data_, start, len);
+            return data_.substr(start, len);
         }
     };
 }
@@ -0,0 +1,116 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define AMPS_SIMD_WIDTH 32
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define AMPS_SIMD_WIDTH 16
+#endif
+
+// byte searches used by the scanner. When the target has SSE2 (or AVX2,
+// if the build enables it) they test 16 (or 32) bytes per step and only
+// fall back to the scalar loop for the tail, on any other target the
+// scalar loop does all the work
+namespace amps::simd
+{
+#ifdef AMPS_SIMD_WIDTH
+    constexpr size_t width = AMPS_SIMD_WIDTH;
+
+    // one bit per byte of the block that is equal to a or b
+    inline uint32_t match_mask(const char *data, char a, char b)
+    {
+    #if AMPS_SIMD_WIDTH == 32
+        __m256i block = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(data));
+        __m256i eq = _mm256_or_si256(
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(a)),
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(b)));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+    #else
+        __m128i block = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(data));
+        __m128i eq = _mm_or_si128(
+                _mm_cmpeq_epi8(block, _mm_set1_epi8(a)),
+                _mm_cmpeq_epi8(block, _mm_set1_epi8(b)));
+        return static_cast<uint32_t>(_mm_movemask_epi8(eq));
+    #endif
+    }
+
+    constexpr uint32_t full_mask = (width == 32) ? 0xffffffffu : 0xffffu;
+#endif
+
+    // position of the first byte equal to a or b, size if there's none
+    inline size_t find_any(const char *data, size_t size, char a, char b)
+    {
+        size_t i = 0;
+
+    #ifdef AMPS_SIMD_WIDTH
+        for (; i + width <= size; i += width) {
+            uint32_t mask = match_mask(data + i, a, b);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    #endif
+
+        for (; i < size; ++i) {
+            if (data[i] == a || data[i] == b) {
+                return i;
+            }
+        }
+
+        return size;
+    }
+
+    // position of the first byte that is neither a nor b, size if
+    // every byte is one of them
+    inline size_t find_other(const char *data, size_t size, char a, char b)
+    {
+        size_t i = 0;
+
+    #ifdef AMPS_SIMD_WIDTH
+        for (; i + width <= size; i += width) {
+            uint32_t mask = ~match_mask(data + i, a, b) & full_mask;
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    #endif
+
+        for (; i < size; ++i) {
+            if (data[i] != a && data[i] != b) {
+                return i;
+            }
+        }
+
+        return size;
+    }
+
+    // how many bytes are equal to c
+    inline size_t count(const char *data, size_t size, char c)
+    {
+        size_t i = 0;
+        size_t total = 0;
+
+    #ifdef AMPS_SIMD_WIDTH
+        for (; i + width <= size; i += width) {
+            total += __builtin_popcount(match_mask(data + i, c, c));
+        }
+    #endif
+
+        for (; i < size; ++i) {
+            if (data[i] == c) {
+                ++total;
+            }
+        }
+
+        return total;
+    }
+}
+
+#endif // SIMD_H
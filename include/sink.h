@@ -0,0 +1,127 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include "config.h"
+
+#include <string>
+#include <ostream>
+#include <functional>
+#include <string_view>
+
+#ifdef __linux__
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+namespace amps
+{
+    // where a render writes its output while it runs. The compiler
+    // buffers what the template prints and hands it over every time
+    // the buffer reaches chunk_size bytes (and once more at the end),
+    // so a render never keeps more than about a chunk of the document
+    // in memory and the first chunk goes out before the rest is
+    // rendered. Template text as big as a chunk isn't buffered, it's
+    // written as it is, straight from the template. write returns false when the output can't be written
+    // anymore, the render stops there
+    class sink
+    {
+        size_t chunk_;
+
+    public:
+        sink(size_t chunk = OUTPUT_CHUNK_SZ) :
+            chunk_(chunk)
+        {
+        }
+
+        virtual ~sink()                 = default;
+
+        sink(const sink&)               = delete;
+        sink(sink&&)                    = delete;
+        sink &operator=(const sink&)    = delete;
+        sink &operator=(sink&&)         = delete;
+
+        size_t chunk_size() const
+        {
+            return chunk_;
+        }
+
+        virtual bool write(std::string_view data) = 0;
+    };
+
+    class ostream_sink : public sink
+    {
+        std::ostream &os_;
+
+    public:
+        ostream_sink(std::ostream &os, size_t chunk = OUTPUT_CHUNK_SZ) :
+            sink(chunk),
+            os_(os)
+        {
+        }
+
+        bool write(std::string_view data) override
+        {
+            os_.write(data.data(), static_cast<std::streamsize>(data.size()));
+            return os_.good();
+        }
+    };
+
+    // writes to a file descriptor the caller owns (a file, a pipe, a
+    // socket...), it's never closed here. Only available on Linux, it
+    // fails to write anywhere else
+    class fd_sink : public sink
+    {
+        int fd_;
+
+    public:
+        fd_sink(int fd, size_t chunk = OUTPUT_CHUNK_SZ) :
+            sink(chunk),
+            fd_(fd)
+        {
+        }
+
+        bool write(std::string_view data) override
+        {
+#ifdef __linux__
+            while (data.size() > 0) {
+                ssize_t count = ::write(fd_, data.data(), data.size());
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (count <= 0) {
+                    return false;
+                }
+
+                data.remove_prefix(static_cast<size_t>(count));
+            }
+
+            return true;
+#else
+            return false;
+#endif
+        }
+    };
+
+    // hands every chunk to the user, the view is only valid during
+    // the call
+    class callback_sink : public sink
+    {
+        std::function<bool(std::string_view)> callback_;
+
+    public:
+        template <typename F>
+        callback_sink(F&& callback, size_t chunk = OUTPUT_CHUNK_SZ) :
+            sink(chunk),
+            callback_(std::forward<F>(callback))
+        {
+        }
+
+        bool write(std::string_view data) override
+        {
+            return callback_(data);
+        }
+    };
+}
+
+#endif // SINK_H
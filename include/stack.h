@@ -2,15 +2,36 @@
 #define STACK_H
 
 #include "types.h"
+#include "config.h"
+
+#include <array>
+#include <memory>
+#include <utility>
 
 namespace amps
 {
+    // the evaluation stack. Expressions rarely keep more than a few
+    // values at once, those fit in the inline storage, a template that
+    // needs more reserves it once (the assembler knows how deep its
+    // expressions go) before it runs. Values are moved in and out (or
+    // built in place), the stack never copies one. Looking at or
+    // popping an empty stack gives an empty object
     class gstack
     {
-        objects stack_;
+        std::array<object, STACK_INLINE_SZ> inline_;
+        std::unique_ptr<object[]> heap_;
+        object *data_;
+        size_t capacity_;
+        size_t size_;
 
     public:
-        gstack()                        = default;
+        gstack() :
+            data_(inline_.data()),
+            capacity_(STACK_INLINE_SZ),
+            size_(0)
+        {
+        }
+
         gstack(const gstack&)           = delete;
         gstack(gstack&&)                = delete;
         ~gstack()                       = default;
@@ -19,41 +40,80 @@ namespace amps
         gstack operator=(gstack&&)      = delete;
 
         object pop();
-        object look_back() const;
-        void push(object_t value);
+        const object &look_back() const;
+        void push(object_t &&value);
+        template <typename... Args>
+        void emplace(Args&&... args);
+        void reserve(size_t capacity);
         void clear();
         bool empty() const;
     };
 
-    inline void gstack::push(object_t value)
+    inline void gstack::reserve(size_t capacity)
+    {
+        if (capacity <= capacity_) {
+            return;
+        }
+
+        auto heap = std::make_unique<object[]>(capacity);
+        for (size_t i = 0; i < size_; ++i) {
+            heap[i] = std::move(data_[i]);
+        }
+
+        heap_ = std::move(heap);
+        data_ = heap_.get();
+        capacity_ = capacity;
+    }
+
+    template <typename... Args>
+    inline void gstack::emplace(Args&&... args)
     {
-        stack_.emplace_back(value);
+        // only a depth the assembler didn't account for gets here
+        if (size_ == capacity_) {
+            reserve(capacity_ * 2);
+        }
+
+        data_[size_++].emplace(std::forward<Args>(args)...);
+    }
+
+    inline void gstack::push(object_t &&value)
+    {
+        emplace(std::move(value));
     }
 
     inline object gstack::pop()
     {
         if (empty()) {
-            return {};
+            return std::nullopt;
         }
 
-        object_t value = stack_.back();
-        stack_.pop_back();
+        object value = std::move(data_[--size_]);
+        data_[size_].reset();
         return value;
     }
 
-    inline object gstack::look_back() const
+    inline const object &gstack::look_back() const
     {
-        return stack_.back();
+        static const object none;
+
+        if (empty()) {
+            return none;
+        }
+
+        return data_[size_ - 1];
     }
 
     inline bool gstack::empty() const
     {
-        return stack_.size() == 0;
+        return size_ == 0;
     }
 
+    // values left behind release the strings they own right away
     inline void gstack::clear()
     {
-        stack_.clear();
+        while (size_ > 0) {
+            data_[--size_].reset();
+        }
     }
 }
 
@@ -2,8 +2,9 @@
 #define TOKEN_H
 
 #include <string>
-#include <optional>
-#include <functional>
+#include <array>
+#include <cstdint>
+#include <string_view>
 
 #define TOKENS              \
     X(IDENTIFIER)           \
@@ -120,17 +121,96 @@ namespace amps
         return os;
     }
 
-    class token_t
+    // KEYWORDS are looked up in a perfect hash table built at compile
+    // time: length, first and last letter give every keyword its own
+    // position, so a lookup is a single string comparison
+    namespace keywords
+    {
+        struct entry
+        {
+            std::string_view text;
+            token_types type;
+        };
+
+        constexpr entry list[] = {
+        #define X(kw, name) {kw, token_types::name},
+            KEYWORDS
+        #undef X
+        };
+
+        constexpr size_t count = sizeof(list) / sizeof(list[0]);
+        constexpr size_t table_size = 64;
+        constexpr uint8_t empty = 0xff;
+
+        constexpr size_t position(std::string_view text)
+        {
+            return (text.size() * 11 +
+                    static_cast<unsigned char>(text.front()) * 2 +
+                    static_cast<unsigned char>(text.back())) % table_size;
+        }
+
+        constexpr std::array<uint8_t, table_size> build_table()
+        {
+            std::array<uint8_t, table_size> table = {};
+            for (auto &slot : table) {
+                slot = empty;
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                table[position(list[i].text)] = static_cast<uint8_t>(i);
+            }
+
+            return table;
+        }
+
+        constexpr std::array<uint8_t, table_size> table = build_table();
+
+        constexpr bool is_perfect()
+        {
+            for (size_t i = 0; i < count; ++i) {
+                if (table[position(list[i].text)] != i) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        static_assert(count < empty, "too many keywords");
+        static_assert(is_perfect(),
+                      "keywords collide, change the hash in "
+                      "keywords::position");
+    }
+
+    // IDENTIFIER when the text isn't a keyword
+    constexpr token_types get_keyword(std::string_view text)
     {
-        using value_t = std::optional<std::string>;
+        if (text.size() == 0) {
+            return token_types::IDENTIFIER;
+        }
+
+        uint8_t idx = keywords::table[keywords::position(text)];
+        if (idx != keywords::empty && keywords::list[idx].text == text) {
+            return keywords::list[idx].type;
+        }
+
+        return token_types::IDENTIFIER;
+    }
 
+    // a token doesn't own its text: identifiers, strings and numbers
+    // refer to the slice of the scanned code they came from, so tokens
+    // are small trivially copyable values and the parser reads their
+    // text as a string_view of that code
+    class token_t
+    {
         token_types type_;
-        value_t value_;
+        uint32_t offset_;
+        uint32_t length_;
 
     public:
         token_t();
         token_t(token_types type);
-        token_t(token_types type, value_t value);
+        token_t(token_types type, size_t offset, size_t length);
         token_t(const token_t&)         = default;
         token_t(token_t &&)             = default;
         ~token_t()                      = default;
@@ -138,23 +218,20 @@ namespace amps
         token_t &operator=(const token_t &)   = default;
         token_t &operator=(token_t &&)  = default;
 
-        std::string to_string() const;
+        std::string to_string(std::string_view source) const;
         token_types type() const;
-        value_t value() const;
-
-        size_t hash() const;
+        std::string_view value(std::string_view source) const;
     };
 
-    inline size_t token_t::hash() const
+    inline std::string token_t::to_string(std::string_view source) const
     {
-        std::hash<std::string> hash_string;
-        return hash_string(to_string());
-    }
-
-    inline std::string token_t::to_string() const
-    {
-        std::string ret = "token: " + get_token_name(type_) +
-                          ", object: " + value_.value_or("<null>");
+        std::string ret = "token: " + get_token_name(type_) + ", object: ";
+        if (length_ == 0) {
+            ret += "<null>";
+        }
+        else {
+            ret += value(source);
+        }
         return ret;
     }
 
@@ -163,9 +240,9 @@ namespace amps
         return type_;
     }
 
-    inline token_t::value_t token_t::value() const
+    inline std::string_view token_t::value(std::string_view source) const
     {
-        return value_;
+        return source.substr(offset_, length_);
     }
 }
 
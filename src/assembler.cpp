@@ -0,0 +1,632 @@
+#include "assembler.h"
+
+using namespace std;
+
+namespace amps
+{
+    program assembler::assemble(const metainfo &info)
+    {
+        program_ = program();
+        depth_ = 0;
+        strings_.clear();
+        slots_.clear();
+        blocks_.clear();
+
+        for (size_t i = 0; i < info.size(); ++i) {
+            const metadata &data = info[i];
+
+            program_.entries.push_back(program_.code.size());
+            line_ = data.range.line;
+
+            if (data.type == metatype::TEXT) {
+                if (data.data.size() > 0 && data.data[0] != 0) {
+                    emit(opcode::TEXT, i, data.data.size());
+                }
+                continue;
+            }
+
+            if (data.type != metatype::CODE && data.type != metatype::ECHO) {
+                continue;
+            }
+
+            // a FAIL ends the block, nothing after it would ever run
+            parser_iterator it(data.tokens, data.data, data.range);
+            while (!it.is_eot()) {
+                if (!lower_statement(it)) {
+                    break;
+                }
+            }
+        }
+        program_.entries.push_back(program_.code.size());
+
+        // blocks never closed jump to the end of the program
+        while (blocks_.size() > 0) {
+            link_block(blocks_.back(), program_.code.size());
+            blocks_.pop_back();
+        }
+
+        for (auto &ins : program_.code) {
+            if (ins.op != opcode::IF && ins.op != opcode::ELIF &&
+                ins.op != opcode::ELSE && ins.op != opcode::FOR) {
+                continue;
+            }
+
+            if (ins.a == npos) {
+                ins.a = program_.code.size();
+            }
+            if (ins.b == npos) {
+                ins.b = program_.code.size();
+            }
+        }
+
+        return std::move(program_);
+    }
+
+    // how many values the instruction leaves on the stack (or takes
+    // from it), only what the expressions evaluate is ever there
+    static int stack_effect(opcode op)
+    {
+        switch (op) {
+            case opcode::PUSH_NUMBER:
+            case opcode::PUSH_STRING:
+            case opcode::PUSH_BOOL:
+            case opcode::LOAD:
+                return 1;
+
+            case opcode::BINARY:
+            case opcode::JUMP_FALSE:
+            case opcode::JUMP_TRUE:
+            case opcode::OUTPUT:
+            case opcode::TEST:
+                return -1;
+
+            case opcode::LOOP_RANGE:
+                return -3;
+
+            default:
+                return 0;
+        }
+    }
+
+    void assembler::track(opcode op)
+    {
+        depth_ += stack_effect(op);
+        if (depth_ > 0 && static_cast<size_t>(depth_) > program_.depth) {
+            program_.depth = depth_;
+        }
+    }
+
+    size_t assembler::emit(opcode op, size_t a, size_t b)
+    {
+        track(op);
+        program_.code.push_back(instruction{op, token_types::EOT,
+                                            static_cast<uint32_t>(line_),
+                                            a, b});
+        return program_.code.size() - 1;
+    }
+
+    size_t assembler::emit(opcode op, token_types oper)
+    {
+        track(op);
+        program_.code.push_back(instruction{op, oper,
+                                            static_cast<uint32_t>(line_),
+                                            0, 0});
+        return program_.code.size() - 1;
+    }
+
+    size_t assembler::slot(string_view name)
+    {
+        string key(name);
+        auto it = slots_.find(key);
+        if (it != slots_.end()) {
+            return it->second;
+        }
+
+        program_.slots.push_back(key);
+        slots_[key] = program_.slots.size() - 1;
+        return program_.slots.size() - 1;
+    }
+
+    size_t assembler::add_loop(opcode type,
+                               string_view key,
+                               string_view value)
+    {
+        loop lp{type, slot(key), 0, slot(string(key) + "_idx")};
+
+        if (type == opcode::LOOP_PAIRS) {
+            lp.value = slot(value);
+        }
+
+        program_.loops.push_back(lp);
+        return program_.loops.size() - 1;
+    }
+
+    size_t assembler::find_block(opcode opener) const
+    {
+        for (size_t i = blocks_.size(); i > 0; --i) {
+            if (program_.code[blocks_[i - 1].front()].op == opener) {
+                return i - 1;
+            }
+        }
+
+        return npos;
+    }
+
+    void assembler::open_block(size_t pc)
+    {
+        blocks_.push_back(vector<size_t>{pc});
+    }
+
+    void assembler::add_clause(size_t pc)
+    {
+        // an elif or else outside of any if has nothing to jump to
+        size_t idx = find_block(opcode::IF);
+        if (idx == npos) {
+            return;
+        }
+
+        // blocks opened inside the if and never closed are dropped
+        while (blocks_.size() > idx + 1) {
+            link_block(blocks_.back(), npos);
+            blocks_.pop_back();
+        }
+
+        blocks_.back().push_back(pc);
+    }
+
+    void assembler::close_block(opcode opener, size_t pc)
+    {
+        size_t idx = find_block(opener);
+        if (idx == npos) {
+            return;
+        }
+
+        while (blocks_.size() > idx + 1) {
+            link_block(blocks_.back(), npos);
+            blocks_.pop_back();
+        }
+
+        link_block(blocks_.back(), pc);
+        blocks_.pop_back();
+    }
+
+    void assembler::link_block(const vector<size_t> &clauses, size_t end)
+    {
+        for (size_t i = 0; i < clauses.size(); ++i) {
+            instruction &ins = program_.code[clauses[i]];
+            size_t next = (i + 1 < clauses.size()) ? clauses[i + 1] : end;
+
+            switch (ins.op) {
+                case opcode::IF:
+                    ins.a = next;
+                    break;
+
+                case opcode::ELIF:
+                    ins.a = next;
+                    ins.b = end;
+                    break;
+
+                case opcode::ELSE:
+                case opcode::FOR:
+                    ins.a = end;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    size_t assembler::intern(string_view str)
+    {
+        string key(str);
+        auto it = strings_.find(key);
+        if (it != strings_.end()) {
+            return it->second;
+        }
+
+        program_.strings.push_back(key);
+        strings_[key] = program_.strings.size() - 1;
+        return program_.strings.size() - 1;
+    }
+
+    bool assembler::lower_statement(parser_iterator &it)
+    {
+        // a statement starts with an empty stack, even when the one
+        // before it failed halfway through an expression
+        depth_ = 0;
+
+        switch (it.look().type()) {
+            case token_types::PRINT:
+                return lower_print(it);
+
+            case token_types::FOR:
+                return lower_for(it);
+
+            case token_types::ENDFOR:
+                it.next();
+                close_block(opcode::FOR, emit(opcode::ENDFOR));
+                return true;
+
+            case token_types::IF:
+                it.next();
+                open_block(emit(opcode::IF, npos));
+                return lower_if(it);
+
+            case token_types::ELIF:
+                it.next();
+                add_clause(emit(opcode::ELIF, npos, npos));
+                return lower_if(it);
+
+            case token_types::ELSE:
+                it.next();
+                add_clause(emit(opcode::ELSE, npos));
+                return true;
+
+            case token_types::ENDIF:
+                it.next();
+                close_block(opcode::IF, emit(opcode::ENDIF));
+                return true;
+
+            case token_types::INSERT:
+                return lower_insert(it);
+
+            // not a statement, silently stop the block
+            default:
+                return fail();
+        }
+    }
+
+    bool assembler::lower_print(parser_iterator &it)
+    {
+        it.next();
+        emit(opcode::PRINT);
+
+        if (!parse_expression(it)) {
+            return false;
+        }
+
+        emit(opcode::OUTPUT);
+        return true;
+    }
+
+    bool assembler::lower_for(parser_iterator &it)
+    {
+        it.next();
+        open_block(emit(opcode::FOR, npos));
+
+        if (!it.match(token_types::IDENTIFIER)) {
+            return fail("loop statement requires an identifier",
+                        ". Line: ", it.range().line);
+        }
+
+        string_view id_or_key = it.value();
+        emit(opcode::DECLARE, slot(id_or_key));
+
+        string_view value;
+        if (it.match(token_types::COMMA)) {
+            if (it.match(token_types::IDENTIFIER)) {
+                value = it.value();
+            }
+            else {
+                return fail("expected identifier after ','. Line: ",
+                            it.range().line);
+            }
+
+            if (id_or_key == value) {
+                return fail("variable ", value,
+                            " already exists, name must be unique",
+                            ". Line: ", it.range().line);
+            }
+            emit(opcode::DECLARE, slot(value));
+        }
+
+        if (!it.match(token_types::IN)) {
+            return fail("expect 'in' operator after identifier. Line: ",
+                        it.range().line);
+        }
+
+        // range expects three arguments, values can be negative
+        // for x in range(b, e, s)
+        //                |  |  +> step
+        //                |  +---> end
+        //                +------> begin
+        bool is_range = it.match(token_types::RANGE);
+        if (is_range && value.size() == 0) {
+
+            if (!it.match(token_types::LEFT_PAREN)) {
+                return fail("expect '('. Line: ", it.range().line);
+            }
+
+            for (unsigned int i = 0; i < 3; i++) {
+                if (!parse_unary(it)) {
+                    return false;
+                }
+
+                emit(opcode::CHECK_NUMBER);
+
+                if (i < 2 && !it.match(token_types::COMMA)) {
+                    return fail("expect ','. Line: ", it.range().line);
+                }
+            }
+
+            if (!it.match(token_types::RIGHT_PAREN)) {
+                return fail("expected closing ')'. Line: ", it.range().line);
+            }
+
+            emit(opcode::LOOP_RANGE,
+                 add_loop(opcode::LOOP_RANGE, id_or_key, ""));
+        }
+
+        // for item in vector
+        // expects only an identifier that represents a vector<number_t>
+        // or vector<string>
+        else if (value.size() == 0 && it.match(token_types::IDENTIFIER)) {
+            string_view vect = it.value();
+            it.next();
+
+            emit(opcode::COLLECTION, slot(vect));
+            emit(opcode::LOOP_EACH,
+                 add_loop(opcode::LOOP_EACH, id_or_key, ""),
+                 slot(vect));
+        }
+
+        // for key, value in table
+        // expects only an identifier that represents an
+        // unordered_map<number_t> or unordered_map<string>
+        else if (value.size() > 0 && it.match(token_types::IDENTIFIER)) {
+            string_view tbl = it.value();
+            it.next();
+
+            emit(opcode::COLLECTION, slot(tbl));
+            emit(opcode::LOOP_PAIRS,
+                 add_loop(opcode::LOOP_PAIRS, id_or_key, value),
+                 slot(tbl));
+        }
+        else {
+            return fail("invalid loop. Line: ", it.range().line);
+        }
+
+        return true;
+    }
+
+    bool assembler::lower_if(parser_iterator &it)
+    {
+        if (!parse_expression(it)) {
+            return false;
+        }
+
+        emit(opcode::TEST);
+        return true;
+    }
+
+    bool assembler::lower_insert(parser_iterator &it)
+    {
+        it.next();
+        emit(opcode::INSERT);
+
+        if (!it.match(token_types::STRING)) {
+            return fail("expected file name string. Line: ",
+                        it.range().line);
+        }
+
+        size_t filename = intern(it.value());
+        program_.inserts.push_back(filename);
+        emit(opcode::INCLUDE, filename, program_.inserts.size() - 1);
+        return true;
+    }
+
+    bool assembler::parse_expression(parser_iterator &it)
+    {
+        return parse_equality(it);
+    }
+
+    bool assembler::parse_equality(parser_iterator &it)
+    {
+        if (!parse_logical(it)) {
+            return false;
+        }
+
+        while (it.match(token_types::EQ)  ||
+               it.match(token_types::NE)) {
+            token_t oper = it.look_back();
+            if (!parse_logical(it)) {
+                return false;
+            }
+
+            emit(opcode::BINARY, oper.type());
+        }
+
+        return true;
+    }
+
+    bool assembler::parse_logical(parser_iterator &it)
+    {
+        if (!parse_comparison(it)) {
+            return false;
+        }
+
+        // short-circuit: the right side is skipped when the left one
+        // is false (and) or true (or)
+        while (it.match(token_types::AND) ||
+               it.match(token_types::OR)) {
+            token_t oper = it.look_back();
+            size_t jump = emit((oper.type() == token_types::AND) ?
+                               opcode::JUMP_FALSE : opcode::JUMP_TRUE);
+
+            bool ok = parse_comparison(it);
+            if (ok) {
+                emit(opcode::TO_BOOL);
+            }
+
+            // a right side that can't be parsed ends with its FAIL
+            program_.code[jump].a = program_.code.size() - (ok ? 0 : 1);
+            if (!ok) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool assembler::parse_comparison(parser_iterator &it)
+    {
+        if (!parse_addition(it)) {
+            return false;
+        }
+
+        while (it.match(token_types::GT) ||
+               it.match(token_types::GE) ||
+               it.match(token_types::LT) ||
+               it.match(token_types::LE)) {
+            token_t oper = it.look_back();
+            if (!parse_addition(it)) {
+                return false;
+            }
+
+            emit(opcode::BINARY, oper.type());
+        }
+
+        return true;
+    }
+
+    bool assembler::parse_addition(parser_iterator &it)
+    {
+        if (!parse_multiplication(it)) {
+            return false;
+        }
+
+        while (it.match(token_types::MINUS) ||
+               it.match(token_types::PLUS)) {
+            token_t oper = it.look_back();
+            if (!parse_multiplication(it)) {
+                return false;
+            }
+
+            emit(opcode::BINARY, oper.type());
+        }
+
+        return true;
+    }
+
+    bool assembler::parse_multiplication(parser_iterator &it)
+    {
+        if (!parse_unary(it)) {
+            return false;
+        }
+
+        while (it.match(token_types::STAR) ||
+               it.match(token_types::SLASH) ||
+               it.match(token_types::PERCENT)) {
+            token_t oper = it.look_back();
+            if (!parse_unary(it)) {
+                return false;
+            }
+
+            emit(opcode::BINARY, oper.type());
+        }
+
+        return true;
+    }
+
+    bool assembler::parse_unary(parser_iterator &it)
+    {
+        if (it.match(token_types::NOT) ||
+            it.match(token_types::MINUS)) {
+            token_t oper = it.look_back();
+            if (!parse_unary(it)) {
+                return false;
+            }
+
+            emit(opcode::UNARY, oper.type());
+            return true;
+        }
+
+        return parse_primary(it);
+    }
+
+    bool assembler::parse_primary(parser_iterator &it)
+    {
+        if (it.match(token_types::NUMBER)) {
+            emit(opcode::PUSH_NUMBER, it.number());
+            return true;
+        }
+        else if (it.match(token_types::STRING)) {
+            emit(opcode::PUSH_STRING, intern(it.value()));
+            return true;
+        }
+        else if (it.match(token_types::TRUE)) {
+            emit(opcode::PUSH_BOOL, 1);
+            return true;
+        }
+        else if (it.match(token_types::FALSE)) {
+            emit(opcode::PUSH_BOOL, 0);
+            return true;
+        }
+        else if (it.match(token_types::SIZE)) {
+            if (!it.match(token_types::LEFT_PAREN)) {
+                return fail("size expects an opening '('", ". Line: ",
+                            it.range().line);
+            }
+
+            if (!parse_expression(it)) {
+                return false;
+            }
+
+            emit(opcode::SIZE);
+
+            if (!it.match(token_types::RIGHT_PAREN)) {
+                return fail("size expects a closing ')'. Line: ",
+                            it.range().line);
+            }
+
+            return true;
+        }
+        else if (it.match(token_types::IDENTIFIER)) {
+            size_t id = slot(it.value());
+
+            // evaluate variable[index] or variable["key"]
+            if (it.match(token_types::LEFT_BRACKET)) {
+                emit(opcode::DEFINED, id);
+
+                // push index or "key"
+                if (!parse_primary(it)) {
+                    return false;
+                }
+
+                // pop the index (or "key") and push variable[x]
+                emit(opcode::LOAD_INDEX, id);
+
+                if (!it.match(token_types::RIGHT_BRACKET)) {
+                    return fail("expect closing ']'. Line: ",
+                                it.range().line);
+                }
+
+                return true;
+            }
+
+            // evaluate a simple variable
+            emit(opcode::LOAD, id);
+            return true;
+        }
+        else if (it.match(token_types::LEFT_PAREN)) {
+            if (!parse_expression(it)) {
+                return false;
+            }
+
+            if (!it.match(token_types::RIGHT_PAREN)) {
+                return fail("expected closing ')'. Line: ",
+                            it.range().line);
+            }
+
+            return true;
+        }
+
+        if (it.is_eot()) {
+            return fail("no token found. Line: ", it.range().line);
+        }
+
+        return fail("unexpected token found: ", it.look().type(),
+                    ". Line: ", it.range().line);
+    }
+}
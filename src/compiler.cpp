@@ -10,901 +10,851 @@ using namespace std;
 namespace amps
 {
     compiler::compiler(error &err) :
-        running_cache_(false),
-        update_main_cache_(false),
-        error_(err),
-        current_cache_(0)
+        error_(err)
     {
     }
 
-    void compiler::reset()
+    string compiler::generate(const compiled_template &tpl,
+                              const user_map &usermap) const
     {
-        running_cache_ = false;
-        update_main_cache_ = false;
-        result_ = string("");
-        current_cache_ = 0;
-        branches_.clear();
-        cache_.clear();
-        context_.reset();
+        render_state state;
+        state.out = nullptr;
+        state.gather = nullptr;
+
+        // the output is reserved once: as big as the last one rendered
+        // or, the first time, as the text the template always prints
+        size_t hint = tpl.size_hint();
+        state.result.reserve((hint > 0) ? hint : tpl.static_size());
+
+        run(tpl, usermap, state);
+        return std::move(state.result);
     }
 
-    string compiler::generate(metainfo &metainfo, const user_map &usermap)
+    bool compiler::generate(const compiled_template &tpl,
+                            const user_map &usermap,
+                            sink &out) const
     {
-        result_ = string("");
-        const size_t &counter = context_.get_counter();
+        render_state state;
+        state.out = &out;
+        state.gather = nullptr;
+
+        // a chunk can overflow by the last thing printed
+        size_t hint = tpl.size_hint();
+        size_t chunk = out.chunk_size();
+        state.result.reserve((hint > 0 && hint < chunk) ? hint : chunk * 2);
+
+        run(tpl, usermap, state);
+        flush(state);
+        return !state.broken;
+    }
 
-        // put user data in the environment table
-        context_.environment_setup(usermap);
+    bool compiler::generate(const compiled_template &tpl,
+                            const user_map &usermap,
+                            gather_output &out) const
+    {
+        render_state state;
+        state.out = nullptr;
+        state.gather = &out;
+        state.pending = 0;
+        out.clear();
+
+        // the arena only holds what isn't the template's own text
+        size_t hint = tpl.size_hint();
+        if (hint > tpl.static_size()) {
+            state.result.reserve(hint - tpl.static_size());
+        }
+
+        run(tpl, usermap, state);
+        cut_segment(state);
+        out.finish(std::move(state.result));
+        return !state.broken;
+    }
 
-        cache_[metainfo.hash()] = block_cache{counter - 1,
-                                              metainfo.size() - 1,
-                                              0, 1};
-        update_main_cache_ = true;
+    void compiler::run(const compiled_template &tpl,
+                       const user_map &usermap,
+                       render_state &state) const
+    {
+        state.written = 0;
+        state.frame = 0;
+        state.broken = false;
 
+        // put user data in the environment table
+        state.ctx.environment_setup(usermap);
 
-        // program main loop
-        for (; counter < metainfo.size(); context_.jump_to(counter + 1)) {
+        execute(tpl, state);
 
-            // if we're finished running a cached code, go back to the
-            // place where the cache was executed
-            if (running_cache_ && cache_[current_cache_].end == counter) {
-                context_.jump_to(cache_[current_cache_].resume);
-                running_cache_ = false;
-                continue;
-            }
+        // a render that stopped says nothing about the size of the output
+        if (!state.broken) {
+            tpl.learn_size(state.written + state.result.size());
+        }
+    }
 
-            // text isn't processed so it only verify if the branch it
-            // belongs to has been taken and print it
-            if (metainfo[counter].type == metatype::TEXT) {
-                if (metainfo[counter].data.size() > 0) {
-                    if (branches_.size() == 0 || branches_.back().taken) {
-                        if (metainfo[counter].data[0] != 0) {
-                            result_ += metainfo[counter].data;
-                        }
-                    }
-                }
+    void compiler::write_static(string_view text, render_state &state) const
+    {
+        // text as big as a chunk goes straight to the sink, the buffer
+        // never grows past a chunk because of it
+        if (state.out != nullptr && text.size() >= state.out->chunk_size()) {
+            flush(state);
+            write_out(text, state);
+            return;
+        }
 
-                continue;
-            }
+        // small pieces of text cost more as segments than copied
+        if (state.gather == nullptr || text.size() < MIN_SEGMENT_SZ) {
+            state.result += text;
+            return;
+        }
 
-            // ignore comment metatypes
-            else if (metainfo[counter].type == metatype::COMMENT) {
-                continue;
-            }
+        cut_segment(state);
+        state.gather->add(text.data(), text.size());
+        state.written += text.size();
+    }
 
-            // execute the program in the meta tags
-            parser_iterator it(metainfo[counter].tokens, metainfo[counter].range);
-            while (!it.is_eot()) {
-                if (!run_statement(it, metainfo)) {
-                    context_.stack_clear();
-                    break;
-                }
-            }
+    // what was printed since the last segment becomes a segment of the
+    // arena
+    void compiler::cut_segment(render_state &state) const
+    {
+        if (state.result.size() > state.pending) {
+            state.gather->add(nullptr, state.result.size() - state.pending);
+            state.pending = state.result.size();
         }
+    }
 
-        // it's not expected to have any branch left after
-        // program execution
-        if (branches_.size() > 0 && branches_.back().type == token_types::FOR) {
-            error_.log("expected closing endfor before EOF");
-            branches_.clear();
+    void compiler::flush(render_state &state) const
+    {
+        if (state.out == nullptr || state.result.size() == 0) {
+            return;
         }
-        else if (branches_.size() > 0 && branches_.back().type == token_types::IF) {
-            error_.log("expected closing endif before EOF");
-            branches_.clear();
+
+        write_out(state.result, state);
+        state.result.clear();
+    }
+
+    // once the sink refused something, nothing else is written to it
+    void compiler::write_out(string_view data, render_state &state) const
+    {
+        if (!state.broken && !state.out->write(data)) {
+            error_.critical("the output cannot be written anymore");
+            state.broken = true;
         }
 
-        return result_;
+        state.written += data.size();
     }
 
-    bool compiler::run_statement(parser_iterator &it, metainfo &metainfo)
+    void compiler::execute(const compiled_template &tpl,
+                           render_state &state) const
     {
-        switch (it.look().type()) {
-            case token_types::PRINT:
-                return run_print(it);
+        const metainfo &metainfo = tpl.get_metainfo();
+        const program &prog = tpl.get_program();
+        const vector<string> &strings = prog.strings;
+        const size_t &counter = state.ctx.get_counter();
+        size_t depth = state.branches.size();
+        size_t loops = state.loops.size();
+        size_t frame = state.frame;
+        token_types statement = token_types::EOT;
+        size_t opener = 0;
+        context &ctx = state.ctx;
+
+        ctx.environment_bind(prog.slots);
+        ctx.stack_reserve(prog.depth);
+
+        // a closing statement never reaches the blocks of the template
+        // inserting this one, their slots and code aren't this one's
+        state.frame = depth;
+
+        // program main loop, the counter points to the next instruction
+        // so jumps and loops simply move it. A branch not taken jumps
+        // straight to the clause matched at compile time and a failing
+        // instruction aborts the rest of its block
+        for (ctx.jump_to(0); counter < prog.code.size();) {
+            size_t pc = counter;
+            const instruction &ins = prog.code[pc];
+            size_t line = ins.line;
+            bool ok = true;
+
+            ctx.jump_to(pc + 1);
+
+            switch (ins.op) {
+                case opcode::TEXT:
+                    write_static(string_view(metainfo[ins.a].data.data(), ins.b),
+                                 state);
+                    break;
 
-            case token_types::FOR:
-                return run_for(it);
+                case opcode::STATIC:
+                    write_static(strings[ins.a], state);
+                    break;
 
-            case token_types::ENDFOR:
-                return run_endfor(it);
+                case opcode::PUSH_NUMBER:
+                    ctx.stack_emplace(number_t(ins.a));
+                    break;
 
-            case token_types::IF:
-                return run_if(it);
+                case opcode::PUSH_STRING:
+                    ctx.stack_emplace(strings[ins.a]);
+                    break;
 
-            case token_types::ELIF:
-                return run_elif(it);
+                case opcode::PUSH_BOOL:
+                    ctx.stack_emplace(ins.a != 0);
+                    break;
 
-            case token_types::ELSE:
-                return run_else(it);
+                case opcode::LOAD:
+                    ok = ctx.slot_is_defined(ins.a);
+                    if (ok) {
+                        ctx.stack_push_from_slot(ins.a);
+                    }
+                    break;
 
-            case token_types::ENDIF:
-                return run_endif(it);
+                case opcode::DEFINED:
+                    ok = ctx.slot_is_defined(ins.a);
+                    break;
 
-            case token_types::INSERT:
-                return run_insert(it, metainfo);
+                case opcode::LOAD_INDEX:
+                    ok = run_load_index(ins.a, line, state);
+                    break;
 
-            default:
-                return false;
-        }
-    }
+                case opcode::SIZE:
+                    ok = run_size(state);
+                    break;
 
-    bool compiler::run_print(parser_iterator &it)
-    {
-        if (branches_.size() > 0 && !branches_.back().taken) {
-            it.skip_all();
-            return true;
-        }
+                case opcode::UNARY: {
+                    auto result = compute_unary(ins.oper, line, ctx);
+                    ok = (result != nullopt);
+                    if (ok) {
+                        ctx.stack_push(std::move(result.value()));
+                    }
+                    break;
+                }
 
-        it.next();
-        if (!parse_expression(it)) {
-            if (inspect_) {
-                inspect_(context_, branches_);
-            }
-            result_ += string("<null>");
-            return false;
-        }
+                case opcode::BINARY: {
+                    auto result = compute(ins.oper, line, ctx);
+                    ok = (result != nullopt);
+                    if (ok) {
+                        ctx.stack_push(std::move(result.value()));
+                    }
+                    break;
+                }
 
-        if (inspect_) {
-            inspect_(context_, branches_);
-        }
+                case opcode::JUMP_FALSE:
+                case opcode::JUMP_TRUE:
+                    ok = run_jump(ins, state);
+                    break;
 
-        auto result = context_.stack_pop();
-        if (result == nullopt) {
-            error_.log("print cannot be evaluated. Line: ",
-                       it.range().line);
-            result_ += string("<null>");
-            return false;
-        }
+                case opcode::TO_BOOL: {
+                    auto value = ctx.stack_pop();
+                    ok = (value != nullopt);
+                    if (ok) {
+                        ctx.stack_emplace(value.value().is_true());
+                    }
+                    break;
+                }
 
-        auto type = result.value().get_type();
-        if (type == vobject_types::STRING) {
-            result_ += result.value().get_string_or("<null>");
-        }
-        else if (type == vobject_types::NUMBER) {
-            int64_t num = static_cast<int64_t>(result.value().get_number_or(0));
-            result_ += to_string(num);
-        }
-        else {
-            result_ += (!result.value().get_bool_or(false)) ? "false" : "true";
-        }
+                case opcode::PRINT:
+                    statement = token_types::PRINT;
+                    break;
 
-        return true;
-    }
+                case opcode::OUTPUT:
+                    statement = token_types::EOT;
+                    ok = run_output(line, state);
+                    break;
 
-    bool compiler::run_for(parser_iterator &it)
-    {
-        it.next();
+                case opcode::IF:
+                    statement = token_types::IF;
+                    opener = pc;
+                    break;
 
-        if (branches_.size() > 0 && !branches_.back().taken) {
-            it.skip_all();
-            branches_.push_back(branch{token_types::FOR, false});
-            return true;
-        }
+                case opcode::ELIF:
+                    // the if (or a previous elif) was taken, the chain
+                    // is over
+                    if (state.branches.size() > state.frame &&
+                        state.branches.back().type == token_types::IF &&
+                        state.branches.back().taken) {
+                        ctx.jump_to(ins.b);
+                        break;
+                    }
 
-        if (!it.match(token_types::IDENTIFIER)) {
-            error_.critical("loop statement requires an identifier",
-                            ". Line: ", it.range().line);
-            return false;
-        }
+                    statement = token_types::IF;
+                    opener = pc;
+                    ok = run_elif(line, state);
+                    break;
 
-        string id_or_key = it.look_back().value().value_or("");
-        if (context_.environment_is_key_defined(id_or_key)) {
-            error_.critical("variable ", id_or_key,
-                            " already exists, name must be unique",
-                            ". Line: ", it.range().line);
-            return false;
-        }
+                case opcode::TEST:
+                    statement = token_types::EOT;
+                    ok = run_test(state);
+                    if (!state.branches.back().taken) {
+                        ctx.jump_to(prog.code[opener].a);
+                    }
+                    break;
 
-        string value = "";
-        if (it.match(token_types::COMMA)) {
-            if (it.match(token_types::IDENTIFIER)) {
-                value = it.look_back().value().value_or("");
-            }
-            else {
-                error_.critical("expected identifier after ','. Line: ",
-                                it.range().line);
-                return false;
-            }
+                case opcode::ELSE:
+                    if (state.branches.size() > state.frame &&
+                        state.branches.back().type == token_types::IF &&
+                        state.branches.back().taken) {
+                        ctx.jump_to(ins.a);
+                        break;
+                    }
 
-            if (context_.environment_is_key_defined(value) ||
-                id_or_key == value) {
-                error_.critical("variable ", value,
-                                " already exists, name must be unique",
-                                ". Line: ", it.range().line);
-                return false;
-            }
-        }
+                    ok = run_else(line, state);
+                    break;
 
-        if (!it.match(token_types::IN)) {
-            error_.critical("expect 'in' operator after identifier. Line: ",
-                            it.range().line);
-            return false;
-        }
+                case opcode::ENDIF:
+                    ok = run_endif(line, state);
+                    break;
 
-        // range expects three arguments, values can be negative
-        // for x in range(b, e, s)
-        //                |  |  +> step
-        //                |  +---> end
-        //                +------> begin
-        if (it.match(token_types::RANGE) && value.size() == 0) {
+                case opcode::FOR:
+                    statement = token_types::FOR;
+                    opener = pc;
+                    break;
 
-            if (!it.match(token_types::LEFT_PAREN)) {
-                error_.critical("expect '('. Line: ", it.range().line);
-                return false;
-            }
+                case opcode::DECLARE:
+                    if (ctx.slot_is_defined(ins.a)) {
+                        error_.critical("variable ", prog.slots[ins.a],
+                                        " already exists, name must be unique",
+                                        ". Line: ", line);
+                        ok = false;
+                    }
+                    break;
 
-            for (unsigned int i = 0; i < 3; i++) {
-                if (!parse_unary(it)) {
-                    return false;
-                }
+                case opcode::COLLECTION:
+                    if (!ctx.slot_is_defined(ins.a)) {
+                        error_.critical("variable ", prog.slots[ins.a],
+                                        " is not defined. Line: ", line);
+                        ok = false;
+                    }
+                    break;
 
-                if (context_.stack_top_type() != vobject_types::NUMBER) {
-                    error_.critical("range expects only numbers. Line: ",
-                                    it.range().line);
-                    return false;
-                }
+                case opcode::CHECK_NUMBER:
+                    if (ctx.stack_empty() ||
+                        ctx.stack_top_type() != vobject_types::NUMBER) {
+                        error_.critical("range expects only numbers. Line: ",
+                                        line);
+                        ok = false;
+                    }
+                    break;
 
-                if (i < 2 && !it.match(token_types::COMMA)) {
-                    error_.critical("expect ','. Line: ", it.range().line);
-                    return false;
-                }
-            }
+                case opcode::LOOP_RANGE:
+                    ok = run_loop_range(prog, ins, state);
+                    break;
 
-            if (!it.match(token_types::RIGHT_PAREN)) {
-                error_.critical("expected closing ')'. Line: ",
-                                it.range().line);
-                return false;
-            }
+                case opcode::LOOP_EACH:
+                    ok = run_loop_each(prog, ins, state);
+                    break;
 
-            int64_t step  = static_cast<int64_t>(context_.stack_pop_number_or(0));
-            int64_t end   = static_cast<int64_t>(context_.stack_pop_number_or(0));
-            int64_t start = static_cast<int64_t>(context_.stack_pop_number_or(0));
-
-            // condition is made or impossible to complete,
-            // set the branch to "not taken" and go to the next
-            // block
-            if (step == 0 || start == end ||
-                (step > 0 && start > end) ||
-                (step < 0 && start < end)) {
-                branches_.push_back(branch{token_types::FOR, false});
-                return true;
-            }
+                case opcode::LOOP_PAIRS:
+                    ok = run_loop_pairs(prog, ins, state);
+                    break;
 
-            vector<number_t> range;
-            for (; ((step < 0 && start > end) || start < end); start += step) {
-                range.emplace_back(start);
-            }
+                case opcode::ENDFOR:
+                    ok = run_endfor(line, state);
+                    break;
 
-            // cannot pass the max number of configured iterations
-            if (range.size() / static_cast<uint64_t>(step) > MAX_ITERATION) {
-                branches_.push_back(branch{token_types::FOR, false});
-                return true;
-            }
+                case opcode::INSERT:
+                    statement = token_types::INSERT;
+                    break;
 
-            context_.environment_add_or_update(string("range" + id_or_key), range);
-            context_.environment_add_or_update(id_or_key, range.at(0));
-            context_.stack_push(object_t(string("range" + id_or_key)));
-            context_.stack_push(object_t(id_or_key));
-            context_.stack_push(object_t(value));
-            context_.stack_push(object_t(number_t(0)));
-            context_.stack_push(object_t(static_cast<number_t>(context_.get_counter())));
-            branches_.push_back(branch{token_types::FOR, true});
-        }
+                case opcode::INCLUDE:
+                    ok = run_include(tpl.get_links()[ins.b],
+                                     strings[ins.a], line, state);
 
-        // for item in vector
-        // expects only an identifier that represents a vector<number_t>
-        // or vector<string>
-        else if (value.size() == 0 && it.match(token_types::IDENTIFIER)) {
-            string vect = it.look_back().value().value_or("");
-            it.next();
-
-            if (!context_.environment_is_key_defined(vect)) {
-                error_.critical("variable ", vect, " is not defined. Line: ",
-                                it.range().line);
-                return false;
-            }
+                    // the inserted template bound its own slots
+                    ctx.environment_bind(prog.slots);
+                    break;
 
-            if (context_.environment_get_size(vect) == 0 ||
-                context_.environment_get_size(vect) > MAX_ITERATION) {
-                branches_.push_back(branch{token_types::FOR, false});
-                return true;
+                case opcode::FAIL:
+                    if (strings[ins.a].size() > 0) {
+                        error_.critical(strings[ins.a]);
+                    }
+                    ok = false;
+                    break;
             }
 
-            context_.environment_add_or_update(string(id_or_key + "_idx"), 0);
-            context_.environment_add_or_update(vect, id_or_key, 0);
-            context_.stack_push(object_t(vect));
-            context_.stack_push(object_t(id_or_key));
-            context_.stack_push(object_t(value));
-            context_.stack_push(object_t(number_t(0)));
-            context_.stack_push(object_t(static_cast<number_t>(context_.get_counter())));
-            branches_.push_back(branch{token_types::FOR, true});
-        }
+            // an empty loop goes straight to its endfor
+            if (ok && (ins.op == opcode::LOOP_RANGE ||
+                       ins.op == opcode::LOOP_EACH ||
+                       ins.op == opcode::LOOP_PAIRS) &&
+                !state.branches.back().taken) {
+                ctx.jump_to(prog.code[opener].a);
+            }
 
-        // for key, value in table
-        // expects only an identifier that represents an
-        // unordered_map<number_t> or unordered_map<string>
-        else if (value.size() > 0 && it.match(token_types::IDENTIFIER)) {
-            string tbl = it.look_back().value().value_or("");
-            it.next();
-
-            if (!context_.environment_is_key_defined(tbl)) {
-                error_.critical("variable ", tbl, " is not defined. Line: ",
-                                it.range().line);
-                return false;
+            if (!ok) {
+                recover(statement, line, state);
+                statement = token_types::EOT;
+                ctx.stack_clear();
+                ctx.jump_to(*upper_bound(prog.entries.begin(),
+                                         prog.entries.end(),
+                                         pc));
             }
 
-            if (context_.environment_get_size(tbl) == 0 ||
-                context_.environment_get_size(tbl) > MAX_ITERATION) {
-                branches_.push_back(branch{token_types::FOR, false});
-                return true;
+            if (state.out != nullptr &&
+                state.result.size() >= state.out->chunk_size()) {
+                flush(state);
             }
 
-            number_t index = 0;
-            index = context_.environment_add_or_update(tbl, id_or_key, value, index);
-            context_.environment_add_or_update(string(id_or_key + "_idx"), 0);
-            context_.stack_push(object_t(tbl));
-            context_.stack_push(object_t(id_or_key));
-            context_.stack_push(object_t(value));
-            context_.stack_push(object_t(index));
-            context_.stack_push(object_t(static_cast<number_t>(context_.get_counter())));
-            branches_.push_back(branch{token_types::FOR, true});
-        }
-        else {
-            error_.critical("invalid loop. Line: ", it.range().line);
-            return false;
+            // nothing else can be written, the render (and the renders
+            // of the templates inserting this one) stops right away
+            if (state.broken) {
+                break;
+            }
         }
 
-        if (inspect_) {
-            inspect_(context_, branches_);
+        // it's not expected to have any branch left after
+        // program execution (unless the render stopped)
+        if (!state.broken && state.branches.size() > depth &&
+            state.branches.back().type == token_types::FOR) {
+            error_.log("expected closing endfor before EOF");
         }
-
-        return true;
+        else if (!state.broken && state.branches.size() > depth &&
+                 state.branches.back().type == token_types::IF) {
+            error_.log("expected closing endif before EOF");
+        }
+        state.branches.resize(depth);
+        state.loops.erase(state.loops.begin() + loops, state.loops.end());
+        state.frame = frame;
     }
 
-    bool compiler::run_endfor(parser_iterator &it)
+    void compiler::recover(token_types statement,
+                           size_t line,
+                           render_state &state) const
     {
-        it.next();
-
-        if (branches_.size() > 0 && !branches_.back().taken) {
+        // a print that can't be evaluated still prints something
+        if (statement == token_types::PRINT) {
             if (inspect_) {
-                inspect_(context_, branches_);
+                inspect_(state.ctx, state.branches);
             }
-            branches_.pop_back();
-            return true;
+            state.result += string("<null>");
+        }
+        else if (statement == token_types::IF) {
+            error_.critical("if cannot be parsed. Line: ", line);
         }
+    }
 
-        if (branches_.size() == 0 ||
-            (branches_.size() > 0 &&
-            branches_.back().type != token_types::FOR)) {
-            error_.critical("endfor doesn't match a for. Line: ",
-                            it.range().line);
-            return false;
+    bool compiler::run_load_index(size_t id,
+                                  size_t line,
+                                  render_state &state) const
+    {
+        // pop the index (or "key"), look for that variable[x] in the
+        // slot and push it onto the stack
+        if (state.ctx.stack_empty()) {
+            state.ctx.stack_emplace(empty_string);
+            return true;
         }
 
-        // get loop parameters
-        number_t counter = context_.stack_pop_number_or(0);
-        number_t index = context_.stack_pop_number_or(0);
-        string value = context_.stack_pop_string_or("");
-        string id_or_key = context_.stack_pop_string_or("");
-        string identifier = context_.stack_pop_string_or("");
-
-        // endfor is currently looping a unordered_map (key, value)
-        if (value.size() > 0) {
-            index = context_.environment_add_or_update(identifier,
-                                                       id_or_key,
-                                                       value,
-                                                       index);
-
-            // clean the context after reaching the last item
-            if (index >= context_.environment_get_size(identifier)) {
-                context_.environment_erase(id_or_key);
-                context_.environment_erase(value);
-                context_.environment_erase(string(id_or_key + "_idx"));
-                branches_.pop_back();
-                return true;
+        vobject_types tp = state.ctx.stack_top_type();
+        if (tp == vobject_types::STRING) {
+            // the key is only looked at, it's never copied
+            object key = state.ctx.stack_pop();
+            const string &index = key.value().get_ref_or(empty_string);
+            if (!state.ctx.stack_push_from_slot(id, index)) {
+                error_.critical(state.ctx.slot_name(id), "[", index,
+                                "] not found. Line: ", line);
             }
         }
-
-        // endfor is currently looping a vector (or range)
-        else {
-            // clean the context after reaching the last item
-            if (++index >= context_.environment_get_size(identifier)) {
-                context_.environment_erase(id_or_key);
-                context_.environment_erase(string("range" + id_or_key));
-                context_.environment_erase(string(id_or_key + "_idx"));
-                branches_.pop_back();
-                return true;
+        else if (tp == vobject_types::NUMBER) {
+            number_t index = state.ctx.stack_pop_number_or(0);
+            if (!state.ctx.stack_push_from_slot(id, index)) {
+                error_.critical(state.ctx.slot_name(id), "[", index,
+                                "] not found. Line: ", line);
             }
-
-            // not the last item yet, update the environment
-            context_.environment_add_or_update(identifier, id_or_key, index);
         }
-
-        // add 1 to the hidden counter if exists
-        context_.environment_increment_value(string(id_or_key + "_idx"));
-
-        // update the data and push them onto the stack
-        context_.stack_push(object_t(identifier));
-        context_.stack_push(object_t(id_or_key));
-        context_.stack_push(object_t(value));
-        context_.stack_push(object_t(index));
-        context_.stack_push(object_t(counter));
-
-        // restart the block execution
-        context_.jump_to(counter);
-
-        if (inspect_) {
-            inspect_(context_, branches_);
+        else {
+            state.ctx.stack_pop();
+            state.ctx.stack_emplace(empty_string);
         }
 
         return true;
     }
 
-    bool compiler::run_if(parser_iterator &it)
+    bool compiler::run_jump(const instruction &ins, render_state &state) const
     {
-        it.next();
-
-        if (branches_.size() > 0 && !branches_.back().taken) {
-            it.skip_all();
-            branches_.push_back(branch{token_types::IF, false});
-            return true;
-        }
-
-        if (!parse_expression(it)) {
-            error_.critical("if cannot be parsed. Line: ", it.range().line);
+        auto value = state.ctx.stack_pop();
+        if (value == nullopt) {
             return false;
         }
 
-        bool ret = context_.stack_pop_resolve_bool();
-        branches_.push_back(branch{token_types::IF, ret});
-
-        if (inspect_) {
-            inspect_(context_, branches_);
+        // the left side decides, it's the result and the right side is
+        // never evaluated
+        bool left = value.value().is_true();
+        if (left == (ins.op == opcode::JUMP_TRUE)) {
+            state.ctx.stack_emplace(left);
+            state.ctx.jump_to(ins.a);
         }
 
         return true;
     }
 
-    bool compiler::run_else(parser_iterator &it)
+    bool compiler::run_size(render_state &state) const
     {
-        it.next();
-
-        if (branches_.size() > 0 && branches_.back().taken) {
-            branches_.back().taken = false;
-            return true;
-        }
-
-        if (branches_.back().type != token_types::IF) {
-            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ",
-                            it.range().line);
+        if (state.ctx.stack_empty()) {
             return false;
         }
 
-        branches_.back().taken = true;
-        if (inspect_) {
-            inspect_(context_, branches_);
+        vobject_types tp = state.ctx.stack_top_type();
+        if (tp == vobject_types::STRING) {
+            auto data = state.ctx.stack_pop();
+            state.ctx.stack_emplace(data.value().get_view_or("").size());
+        }
+        else if (tp == vobject_types::NUMBER) {
+            number_t data = state.ctx.stack_pop_number_or(0);
+            state.ctx.stack_emplace(sizeof(data));
+        }
+        else if (tp == vobject_types::BOOL) {
+            state.ctx.stack_pop();
+            state.ctx.stack_emplace(number_t(1));
+        }
+        else if (tp == vobject_types::OBJECT) {
+            string data = state.ctx.stack_pop_string_or("");
+            state.ctx.stack_emplace(state.ctx.environment_get_size(data));
         }
 
         return true;
     }
 
-    bool compiler::run_elif(parser_iterator &it)
+    bool compiler::run_output(size_t line, render_state &state) const
     {
-        if (branches_.size() > 0 && branches_.back().taken) {
-            it.skip_all();
-            return true;
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
-        if (branches_.back().type != token_types::IF) {
-            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ",
-                            it.range().line);
+        auto result = state.ctx.stack_pop();
+        if (result == nullopt) {
+            error_.log("print cannot be evaluated. Line: ", line);
+            state.result += string("<null>");
             return false;
         }
 
-        branches_.pop_back();
-        return run_if(it);
+        result.value().print(state.result);
+        return true;
     }
 
-    bool compiler::run_endif(parser_iterator &it)
+    bool compiler::run_test(render_state &state) const
     {
-        it.next();
+        bool ret = state.ctx.stack_pop_resolve_bool();
+        state.branches.push_back(branch{token_types::IF, ret});
 
-        if (branches_.size() == 0 || branches_.back().type != token_types::IF) {
-            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ",
-                            it.range().line);
-            return false;
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
-        branches_.pop_back();
         return true;
     }
 
-    bool compiler::run_insert(parser_iterator &it, metainfo &info)
+    bool compiler::run_loop_range(const program &prog,
+                                  const instruction &ins,
+                                  render_state &state) const
     {
-        it.next();
-
-        if (branches_.size() > 0 && !branches_.back().taken) {
-            it.skip_all();
+        int64_t step  = static_cast<int64_t>(state.ctx.stack_pop_number_or(0));
+        int64_t end   = static_cast<int64_t>(state.ctx.stack_pop_number_or(0));
+        int64_t start = static_cast<int64_t>(state.ctx.stack_pop_number_or(0));
+
+        // condition is made or impossible to complete,
+        // set the branch to "not taken" and go to the next
+        // block
+        if (step == 0 || start == end ||
+            (step > 0 && start > end) ||
+            (step < 0 && start < end)) {
+            state.branches.push_back(branch{token_types::FOR, false});
             return true;
         }
 
-        if (!it.match(token_types::STRING)) {
-            error_.critical("expected file name string. Line: ",
-                            it.range().line);
-            return false;
-        }
+        // number of items computed upfront, so the iteration limit
+        // is checked before doing any work
+        uint64_t distance = (step > 0) ?
+            static_cast<uint64_t>(end) - static_cast<uint64_t>(start) :
+            static_cast<uint64_t>(start) - static_cast<uint64_t>(end);
+        uint64_t stride = (step > 0) ?
+            static_cast<uint64_t>(step) :
+            uint64_t(0) - static_cast<uint64_t>(step);
+        uint64_t size = (distance - 1) / stride + 1;
 
-        string filename = it.look_back().value().value_or("");
-        if (!is_readable_file(filename)) {
-            error_.critical("template ", filename, " cannot be accessed",
-                            "Line: ", it.range().line);
-            return false;
+        // cannot pass the max number of configured iterations
+        if (size > MAX_ITERATION) {
+            state.branches.push_back(branch{token_types::FOR, false});
+            return true;
         }
 
-        size_t counter = context_.get_counter();
-        scan insert_scan(error_);
-        insert_scan.do_scan(read_full(filename));
-        metainfo &new_info = insert_scan.get_metainfo();
+        state.loops.push_back(loop_frame{&prog.loops[ins.a],
+                                         nullptr,
+                                         start,
+                                         step,
+                                         pairs_cursor(),
+                                         0,
+                                         size,
+                                         state.ctx.get_counter()});
+        bind_item(state.loops.back(), state);
+        state.branches.push_back(branch{token_types::FOR, true});
 
-        if (update_main_cache_) {
-            cache_[info.hash()].end = counter;
-            update_main_cache_ = false;
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
-        auto cache_it = cache_.find(new_info.hash());
+        return true;
+    }
 
-        // the block inserted isn't cached: cache it, put the content in
-        // the current program and execute it
-        if (cache_it == cache_.end()) {
+    bool compiler::run_loop_each(const program &prog,
+                                 const instruction &ins,
+                                 render_state &state) const
+    {
+        // for item in vector
+        // expects only an identifier that represents a vector<number_t>
+        // or vector<string>
+        const loop &lp = prog.loops[ins.a];
+        size_t size = state.ctx.slot_get_size(ins.b);
 
-            for (auto &kv : cache_) {
-                if (counter >= kv.second.start &&
-                        counter <= kv.second.end) {
-                    kv.second.end = new_info.size() + counter;
-                }
-            }
+        if (size == 0 || size > MAX_ITERATION) {
+            state.branches.push_back(branch{token_types::FOR, false});
+            return true;
+        }
+
+        state.loops.push_back(loop_frame{&lp,
+                                         state.ctx.slot_get_variable(ins.b),
+                                         0,
+                                         0,
+                                         pairs_cursor(),
+                                         0,
+                                         size,
+                                         state.ctx.get_counter()});
+        state.ctx.slot_set(lp.index, number_t(0));
+        bind_item(state.loops.back(), state);
+        state.branches.push_back(branch{token_types::FOR, true});
 
-            auto diff = static_cast<metainfo::difference_type>(counter);
-            cache_[new_info.hash()] = block_cache{counter - 1,
-                                                  new_info.size() + counter,
-                                                  0, 1};
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
+        }
 
-            size_t new_size = new_info.size();
-            copy(info.begin() + diff + 1, info.end(), back_inserter(new_info));
-            info.resize(info.size() + new_size);
-            copy(new_info.begin(), new_info.end(), info.begin() + diff);
+        return true;
+    }
+
+    bool compiler::run_loop_pairs(const program &prog,
+                                  const instruction &ins,
+                                  render_state &state) const
+    {
+        // for key, value in table
+        // expects only an identifier that represents an
+        // unordered_map<number_t> or unordered_map<string>
+        const loop &lp = prog.loops[ins.a];
+        const user_var *tbl = state.ctx.slot_get_variable(ins.b);
+        size_t size = state.ctx.slot_get_size(ins.b);
 
-            // restart the block execution
-            context_.jump_to(counter - 1);
+        if (size == 0 || size > MAX_ITERATION) {
+            state.branches.push_back(branch{token_types::FOR, false});
+            return true;
         }
 
-        // the block is cached: execute it
-        else {
+        // the loop keeps its own iterator, so each step is O(1) and
+        // the whole loop is linear on the map size. Entries with an
+        // empty key are skipped
+        pairs_cursor pairs;
+        bool found = std::visit([&](const auto &var) -> bool {
+            using T = std::decay_t<decltype(var)>;
 
-            for (auto &kv : cache_) {
-                if (counter >= kv.second.start &&
-                        counter <= kv.second.end) {
-                    kv.second.end = counter;
+            if constexpr (std::is_same_v<T, m_number> ||
+                          std::is_same_v<T, m_string>) {
+                auto it = var.begin();
+                while (it != var.end() && it->first.size() == 0) {
+                    ++it;
                 }
+
+                pairs = std::pair(it, var.end());
+                return it != var.end();
             }
 
-            // remove the "insert" code...
-            info.remove(counter);
+            return false;
+        }, *tbl);
 
-            if (++cache_it->second.iterations > MAX_ITERATION) {
-                error_.critical(filename, " has run for more than ",
-                                MAX_ITERATION, ", cannot execute it",
-                                ". Line:", it.range().line);
-                return true;
-            }
+        if (!found) {
+            state.branches.push_back(branch{token_types::FOR, false});
+            return true;
+        }
 
-            // ...and execute the cached code
-            cache_it->second.resume = counter - 1;
-            context_.jump_to(cache_it->second.start);
+        state.loops.push_back(loop_frame{&lp,
+                                         tbl,
+                                         0,
+                                         0,
+                                         pairs,
+                                         0,
+                                         size,
+                                         state.ctx.get_counter()});
+        state.ctx.slot_set(lp.index, number_t(0));
+        bind_item(state.loops.back(), state);
+        state.branches.push_back(branch{token_types::FOR, true});
 
-            running_cache_ = true;
-            current_cache_ = cache_it->first;
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
         return true;
     }
 
-    bool compiler::parse_expression(parser_iterator &it)
+    void compiler::bind_item(const loop_frame &frame,
+                             render_state &state) const
     {
-        return parse_equality(it);
-    }
+        const loop &lp = *frame.info;
 
-    bool compiler::parse_equality(parser_iterator &it)
-    {
-        if (!parse_logical(it)) {
-            return false;
+        if (lp.type == opcode::LOOP_RANGE) {
+            int64_t item = frame.start +
+                           static_cast<int64_t>(frame.cursor) * frame.step;
+            state.ctx.slot_set(lp.key, static_cast<number_t>(item));
         }
 
-        while (it.match(token_types::EQ)  ||
-               it.match(token_types::NE)) {
-            token_t oper = it.look_back();
-            if (!parse_logical(it)) {
-                return false;
-            }
+        // vector items are bound by reference, strings aren't copied
+        else if (lp.type == opcode::LOOP_EACH) {
+            std::visit([&](const auto &var) {
+                using T = std::decay_t<decltype(var)>;
 
-            auto result = compute(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
-            }
-            context_.stack_push(result.value());
+                if constexpr (std::is_same_v<T, v_number>) {
+                    state.ctx.slot_set(lp.key, var[frame.cursor]);
+                }
+                else if constexpr (std::is_same_v<T, v_string>) {
+                    state.ctx.slot_set(lp.key, &var[frame.cursor]);
+                }
+            }, *frame.collection);
         }
 
-        return true;
+        // so are the key and the value of map entries
+        else {
+            std::visit([&](const auto &range) {
+                using V = std::decay_t<decltype(range.first->second)>;
+
+                state.ctx.slot_set(lp.key, &range.first->first);
+                if constexpr (std::is_same_v<V, std::string>) {
+                    state.ctx.slot_set(lp.value, &range.first->second);
+                }
+                else {
+                    state.ctx.slot_set(lp.value, range.first->second);
+                }
+            }, frame.pairs);
+        }
     }
 
-    bool compiler::parse_logical(parser_iterator &it)
+    bool compiler::run_endfor(size_t line, render_state &state) const
     {
-        if (!parse_comparison(it)) {
+        if (state.branches.size() > state.frame &&
+            !state.branches.back().taken) {
+            if (inspect_) {
+                inspect_(state.ctx, state.branches);
+            }
+            state.branches.pop_back();
+            return true;
+        }
+
+        if (state.branches.size() == state.frame ||
+            state.branches.back().type != token_types::FOR) {
+            error_.critical("endfor doesn't match a for. Line: ", line);
             return false;
         }
 
-        while (it.match(token_types::AND) ||
-               it.match(token_types::OR)) {
-            token_t oper = it.look_back();
-            if (!parse_comparison(it)) {
-                return false;
-            }
+        loop_frame &frame = state.loops.back();
+        const loop &lp = *frame.info;
 
-            auto result = compute(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
+        // move to the next item, skipping empty map keys
+        bool more = (++frame.cursor < frame.end);
+        if (lp.type == opcode::LOOP_PAIRS) {
+            more = std::visit([](auto &range) -> bool {
+                do {
+                    ++range.first;
+                } while (range.first != range.second &&
+                         range.first->first.size() == 0);
+
+                return range.first != range.second;
+            }, frame.pairs);
+        }
+
+        // clean the context after reaching the last item
+        if (!more) {
+            state.ctx.slot_erase(lp.key);
+            if (lp.type == opcode::LOOP_PAIRS) {
+                state.ctx.slot_erase(lp.value);
             }
-            context_.stack_push(result.value());
+            state.ctx.slot_erase(lp.index);
+            state.loops.pop_back();
+            state.branches.pop_back();
+            return true;
         }
 
-        return true;
-    }
+        // not the last item yet, bind the loop variables to it
+        bind_item(frame, state);
 
-    bool compiler::parse_comparison(parser_iterator &it)
-    {
-        if (!parse_addition(it)) {
-            return false;
+        // the hidden counter only exists in vector and map loops
+        if (lp.type != opcode::LOOP_RANGE) {
+            state.ctx.slot_set(lp.index, static_cast<number_t>(frame.cursor));
         }
 
-        while (it.match(token_types::GT) ||
-               it.match(token_types::GE) ||
-               it.match(token_types::LT) ||
-               it.match(token_types::LE)) {
-            token_t oper = it.look_back();
-            if (!parse_addition(it)) {
-                return false;
-            }
+        // restart the block execution
+        state.ctx.jump_to(frame.body);
 
-            auto result = compute(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
-            }
-            context_.stack_push(result.value());
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
         return true;
     }
 
-    bool compiler::parse_addition(parser_iterator &it)
+    bool compiler::run_else(size_t line, render_state &state) const
     {
-        if (!parse_multiplication(it)) {
+        if (state.branches.size() == state.frame ||
+            state.branches.back().type != token_types::IF) {
+            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ", line);
             return false;
         }
 
-        while (it.match(token_types::MINUS) ||
-               it.match(token_types::PLUS)) {
-            token_t oper = it.look_back();
-            if (!parse_multiplication(it)) {
-                return false;
-            }
-
-            auto result = compute(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
-            }
-            context_.stack_push(result.value());
+        state.branches.back().taken = true;
+        if (inspect_) {
+            inspect_(state.ctx, state.branches);
         }
 
         return true;
     }
 
-    bool compiler::parse_multiplication(parser_iterator &it)
+    bool compiler::run_elif(size_t line, render_state &state) const
     {
-        if (!parse_unary(it)) {
+        if (state.branches.size() == state.frame ||
+            state.branches.back().type != token_types::IF) {
+            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ", line);
             return false;
         }
 
-        while (it.match(token_types::STAR) ||
-               it.match(token_types::SLASH) ||
-               it.match(token_types::PERCENT)) {
-            token_t oper = it.look_back();
-            if (!parse_unary(it)) {
-                return false;
-            }
-
-            auto result = compute(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
-            }
-            context_.stack_push(result.value());
-        }
-
+        state.branches.pop_back();
         return true;
     }
 
-    bool compiler::parse_unary(parser_iterator &it)
+    bool compiler::run_endif(size_t line, render_state &state) const
     {
-        if (it.match(token_types::NOT) ||
-            it.match(token_types::MINUS)) {
-            token_t oper = it.look_back();
-            if (!parse_unary(it)) {
-                return false;
-            }
-
-            auto result = compute_unary(oper.type(), it.range().line);
-            if (result == nullopt) {
-                return false;
-            }
-            context_.stack_push(result.value());
-        }
-        else {
-            if (!parse_primary(it)) {
-                return false;
-            }
+        if (state.branches.size() == state.frame ||
+            state.branches.back().type != token_types::IF) {
+            error_.critical("expected ENDIF, ELSE, or ELIF. Line: ", line);
+            return false;
         }
 
+        state.branches.pop_back();
         return true;
     }
 
-    bool compiler::parse_primary(parser_iterator &it)
+    bool compiler::run_include(const insert_link &link,
+                               const string &filename,
+                               size_t line,
+                               render_state &state) const
     {
-        if (it.match(token_types::NUMBER)) {
-            number_t value = stoul(it.look_back().value().value_or("0"));
-            context_.stack_push(object_t(value));
-            return true;
-        }
-        else if (it.match(token_types::STRING)) {
-            string value = it.look_back().value().value_or("");
-            context_.stack_push(object_t(value));
-            return true;
-        }
-        else if (it.match(token_types::TRUE)) {
-            context_.stack_push(object_t(true));
-            return true;
-        }
-        else if (it.match(token_types::FALSE)) {
-            context_.stack_push(object_t(false));
-            return true;
-        }
-        else if (it.match(token_types::SIZE)) {
-            if (it.match(token_types::LEFT_PAREN)) {
-                if (!parse_expression(it)) {
-                    return false;
-                }
-
-                if (context_.stack_empty()) {
-                    return false;
-                }
-
-                vobject_types tp = context_.stack_top_type();
-                if (tp == vobject_types::STRING) {
-                    std::string data = context_.stack_pop_string_or("");
-                    context_.stack_push(object_t(data.size()));
-                }
-                else if (tp == vobject_types::NUMBER) {
-                    number_t data = context_.stack_pop_number_or(0);
-                    context_.stack_push(object_t(sizeof(data)));
-                }
-                else if (tp == vobject_types::BOOL) {
-                    context_.stack_pop();
-                    context_.stack_push(object_t(number_t(1)));
-                }
-                else if (tp == vobject_types::OBJECT) {
-                    std::string data = context_.stack_pop_string_or("");
-                    context_.stack_push(object_t(context_.environment_get_size(data)));
-                }
-
-                if (!it.match(token_types::RIGHT_PAREN)) {
-                    error_.critical("size expects a closing ')'. Line: ",
-                                    it.range().line);
-                    return false;
-                }
-
-                return true;
-            }
-            else {
-                error_.critical("size expects an opening '('", ". Line: ",
-                                it.range().line);
-                return false;
-            }
+        if (link.status == link_status::MISSING) {
+            error_.critical("template ", filename, " cannot be accessed",
+                            "Line: ", line);
+            return false;
         }
-        else if (it.match(token_types::IDENTIFIER)) {
-            string id = it.look_back().value().value_or("");
-            if (!context_.environment_is_key_defined(id)) {
-                return false;
-            }
-
-            // evaluate variable[index] or variable["key"]
-            if (it.match(token_types::LEFT_BRACKET)) {
-                // push "variable"
-                context_.stack_push(object_t(id));
-
-                // push index or "key"
-                if (!parse_primary(it)) {
-                    return false;
-                }
-
-                // pop variable and (index or "key"), look for that
-                // variable[x] in the environment and push it onto
-                // the stack
-                vobject_types tp = context_.stack_top_type();
-                if (tp == vobject_types::STRING) {
-                    std::string index = context_.stack_pop_string_or("");
-                    std::string id = context_.stack_pop_string_or("");
-                    if(!context_.stack_push_from_environment(id, index)) {
-                        error_.critical(id, "[", index, "] not found",
-                                        ". Line: ", it.range().line);
-                    }
-                }
-                else if (tp == vobject_types::NUMBER) {
-                    number_t index = context_.stack_pop_number_or(0);
-                    std::string id = context_.stack_pop_string_or("");
-                    if (!context_.stack_push_from_environment(id, index)) {
-                        error_.critical(id, "[", index, "] not found",
-                                        ". Line: ", it.range().line);
-                    }
-                }
-                else {
-                    context_.stack_pop();
-                    context_.stack_push(object_t(std::string("")));
-                }
-
-                if (!it.match(token_types::RIGHT_BRACKET)) {
-                    error_.critical("expect closing ']'. Line: ",
-                                    it.range().line);
-                    return false;
-                }
-
-                return true;
-            }
-
-            // evaluate a simple variable. Variable was already evaluated
-            // (context_.environment_is_key_defined(id) above
-            else {
-                context_.stack_push_from_environment(id);
-            }
 
+        // the linker refused a template already inserted up in the chain
+        if (link.status == link_status::CYCLE) {
+            error_.critical("template ", filename, " inserts itself",
+                            ". Line: ", line);
             return true;
         }
-        else if (it.match(token_types::LEFT_PAREN)) {
-            if (!parse_expression(it)) {
-                return false;
-            }
 
-            if (!it.match(token_types::RIGHT_PAREN)) {
-                error_.critical("expected closing ')'. Line: ",
-                                it.range().line);
-                return false;
-            }
+        // the inserted template runs in place, with the same environment,
+        // and the execution resumes right after the insert when it's done
+        size_t counter = state.ctx.get_counter();
+        execute(*link.unit, state);
+        state.ctx.jump_to(counter);
 
-            return true;
-        }
-        else {
-            if (it.is_eot()) {
-                error_.critical("no token found. Line: ",
-                                it.range().line);
-            }
-            else {
-                error_.critical("unexpected token found: ", it.look().type(),
-                                ". Line: ", it.range().line);
-            }
-            return false;
-        }
+        return true;
     }
 
-    object compiler::compute_numbers(number_t a,
-                                     number_t b,
-                                     token_types oper, size_t line)
+    static object apply_numbers(number_t a, number_t b, token_types oper)
     {
         switch(oper) {
             case token_types::MINUS:
@@ -915,14 +865,12 @@ namespace amps
 
             case token_types::SLASH:
                 if (b == 0) {
-                    error_.critical("cannot divide by 0. Line: ", line);
                     return nullopt;
                 }
                 return object_t(a / b);
 
             case token_types::PERCENT:
                 if (b == 0) {
-                    error_.critical("cannot divide by 0. Line: ", line);
                     return nullopt;
                 }
                 return object_t(a % b);
@@ -948,24 +896,21 @@ namespace amps
             case token_types::LE:
                 return object_t(a <= b);
 
-            case token_types::AND:
-                return object_t(a && b);
-
-            case token_types::OR:
-                return object_t(a || b);
-
             default:
                 return nullopt;
         }
     }
 
-    object compiler::compute_strings(string a,
-                                     string b,
-                                     token_types oper)
+    static object apply_strings(string_view a, string_view b, token_types oper)
     {
         switch(oper) {
-            case token_types::PLUS:
-                return object_t(a + b);
+            // the only operator building a new string
+            case token_types::PLUS: {
+                string result;
+                result.reserve(a.size() + b.size());
+                result.append(a).append(b);
+                return object_t(std::move(result));
+            }
 
             case token_types::EQ:
                 return object_t(a == b);
@@ -990,82 +935,100 @@ namespace amps
         }
     }
 
-    object compiler::compute(token_types oper, size_t line)
+    static object apply_bools(bool a, bool b, token_types oper)
     {
-        auto vb = context_.stack_pop();
-        auto va = context_.stack_pop();
+        switch(oper) {
+            case token_types::EQ:
+                return object_t(a == b);
 
-        if (va == nullopt || vb == nullopt) {
-            return nullopt;
+            case token_types::NE:
+                return object_t(a != b);
+
+            default:
+                return object_t(false);
         }
+    }
 
-        auto va_type = va.value().get_type();
-        auto vb_type = vb.value().get_type();
+    object apply_binary(token_types oper, const object_t &a, const object_t &b)
+    {
+        auto a_type = a.get_type();
+        auto b_type = b.get_type();
 
-        if (va_type == vobject_types::NUMBER && vb_type == vobject_types::NUMBER) {
-            return compute_numbers(va.value().get_number_or(0),
-                                   vb.value().get_number_or(0),
-                                   oper, line);
+        if (a_type == vobject_types::NUMBER && b_type == vobject_types::NUMBER) {
+            return apply_numbers(a.get_number_or(0), b.get_number_or(0), oper);
         }
-        else if (va_type == vobject_types::STRING && vb_type == vobject_types::STRING) {
-            return compute_strings(va.value().get_string_or(""),
-                                   vb.value().get_string_or(""),
-                                   oper);
+        else if (a_type == vobject_types::STRING && b_type == vobject_types::STRING) {
+            return apply_strings(a.get_view_or(""), b.get_view_or(""), oper);
+        }
+        else if (a_type == vobject_types::BOOL && b_type == vobject_types::BOOL) {
+            return apply_bools(a.get_bool_or(false), b.get_bool_or(false), oper);
         }
-        else if (va_type == vobject_types::BOOL && vb_type == vobject_types::BOOL) {
-            bool a = va.value().get_bool_or(false);
-            bool b = vb.value().get_bool_or(false);
-
-            switch(oper) {
-                case token_types::EQ:
-                    return object_t(a == b);
-
-                case token_types::NE:
-                    return object_t(a != b);
 
-                case token_types::AND:
-                    return object_t(a && b);
+        return nullopt;
+    }
 
-                case token_types::OR:
-                    return object_t(a || b);
+    object apply_unary(token_types oper, const object_t &value)
+    {
+        auto type = value.get_type();
 
-                default:
-                    return object_t(false);
-            }
+        if (oper == token_types::MINUS && type == vobject_types::NUMBER) {
+            return object_t(value.get_number_or(0) * static_cast<uint64_t>(-1));
+        }
+        else if (oper == token_types::NOT && type == vobject_types::NUMBER) {
+            return object_t((value.get_number_or(0) == 0) ? true : false);
+        }
+        else if (oper == token_types::NOT && type == vobject_types::STRING) {
+            return object_t((value.get_view_or("").size() == 0) ? true : false);
         }
-
-        error_.critical("Mismatched types. ", va_type, " [",
-                        va.value().get_number_or(0),
-                        "] cannot compute with ",
-                        vb_type, " [", vb.value().get_number_or(0),
-                        "]. Line: ", line);
 
         return nullopt;
     }
 
-    object compiler::compute_unary(token_types oper, size_t line)
+    object compiler::compute(token_types oper, size_t line, context &ctx) const
     {
-        auto t = context_.stack_pop();
-        if (t == nullopt) {
+        auto vb = ctx.stack_pop();
+        auto va = ctx.stack_pop();
+
+        if (va == nullopt || vb == nullopt) {
             return nullopt;
         }
 
-        auto type = t.value().get_type();
+        auto va_type = va.value().get_type();
+        auto vb_type = vb.value().get_type();
 
-        if (oper == token_types::MINUS && type == vobject_types::NUMBER) {
-            return object_t(t.value().get_number_or(0) * static_cast<uint64_t>(-1));
+        if (va_type == vobject_types::NUMBER && vb_type == vobject_types::NUMBER &&
+            (oper == token_types::SLASH || oper == token_types::PERCENT) &&
+            vb.value().get_number_or(0) == 0) {
+            error_.critical("cannot divide by 0. Line: ", line);
+            return nullopt;
         }
-        else if (oper == token_types::NOT && type == vobject_types::NUMBER) {
-            return object_t((t.value().get_number_or(0) == 0) ? true : false);
+
+        if (va_type != vb_type || va_type == vobject_types::OBJECT) {
+            error_.critical("Mismatched types. ", va_type, " [",
+                            va.value().get_number_or(0),
+                            "] cannot compute with ",
+                            vb_type, " [", vb.value().get_number_or(0),
+                            "]. Line: ", line);
+            return nullopt;
         }
-        else if (oper == token_types::NOT && type == vobject_types::STRING) {
-            return object_t((t.value().get_string_or("").size() == 0) ? true : false);
+
+        return apply_binary(oper, va.value(), vb.value());
+    }
+
+    object compiler::compute_unary(token_types oper, size_t line, context &ctx) const
+    {
+        auto t = ctx.stack_pop();
+        if (t == nullopt) {
+            return nullopt;
         }
 
-        error_.critical("Unary operator '", oper,
-                        "' cannot be used with value '",
-                        t.value().to_string(), ". Line: ", line);
+        object result = apply_unary(oper, t.value());
+        if (result == nullopt) {
+            error_.critical("Unary operator '", oper,
+                            "' cannot be used with value '",
+                            t.value().to_string(), ". Line: ", line);
+        }
 
-        return nullopt;
+        return result;
     }
 }
@@ -2,38 +2,86 @@
 
 namespace amps
 {
-    using v_number = std::vector<number_t>;
-    using v_string = std::vector<std::string>;
-    using m_number = std::unordered_map<std::string, number_t>;
-    using m_string = std::unordered_map<std::string, std::string>;
+    static size_t variable_size(const user_var &data)
+    {
+        return std::visit([](const auto &var) -> size_t {
+            using T = std::decay_t<decltype(var)>;
 
-    bool context::stack_push_from_environment(const std::string &key)
+            if constexpr (std::is_same_v<T, v_number> ||
+                          std::is_same_v<T, v_string> ||
+                          std::is_same_v<T, m_number> ||
+                          std::is_same_v<T, m_string>) {
+                return var.size();
+            }
+
+            return 0;
+        }, data);
+    }
+
+    bool binding_equals(const binding &bind, const user_var &data)
     {
-        // simply push the value of environment_[key] onto the stack
+        return std::visit([&](const auto &var) -> bool {
+            using T = std::decay_t<decltype(var)>;
+
+            if constexpr (std::is_same_v<T, const user_var*>) {
+                return *var == data;
+            }
+            else if constexpr (std::is_same_v<T, const std::string*>) {
+                auto str = std::get_if<std::string>(&data);
+                return str != nullptr && *str == *var;
+            }
+            else if constexpr (std::is_same_v<T, number_t>) {
+                auto num = std::get_if<number_t>(&data);
+                return num != nullptr && *num == var;
+            }
+
+            return false;
+        }, bind);
+    }
+
+    bool context::stack_push_from_slot(size_t slot)
+    {
+        // simply push the value bound to the slot onto the stack
         // this method only handles string and number value types
+        const user_var *data = slot_get_variable(slot);
+        if (data == nullptr) {
+            if (auto str = std::get_if<const std::string*>(&slots_[slot])) {
+                stack_emplace(**str);
+            }
+            else if (auto num = std::get_if<number_t>(&slots_[slot])) {
+                stack_emplace(*num);
+            }
+
+            return true;
+        }
+
         return std::visit([&](auto &&var) -> bool {
             using T = std::decay_t<decltype(var)>;
 
             if constexpr (std::is_same_v<T, number_t> ||
                           std::is_same_v<T, std::string> ||
                           std::is_same_v<T, bool>) {
-                stack_push(object_t(var));
+                stack_emplace(var);
             }
 
             // object exists but it's not a simple number or string
             // evaluate it to true to represent that it's valid
             else {
-                stack_push(object_t(key, vobject_types::OBJECT));
+                stack_emplace(slot_name(slot), vobject_types::OBJECT);
             }
 
             return true;
-        }, environment_[key]);
+        }, *data);
     }
 
-    bool context::stack_push_from_environment(const std::string &key,
-                                              size_t index)
+    bool context::stack_push_from_slot(size_t slot, size_t index)
     {
-        // simply push the value of environment_[key] onto the stack
+        const user_var *data = slot_get_variable(slot);
+        if (data == nullptr) {
+            return true;
+        }
+
+        // simply push the value bound to the slot onto the stack
         // this method handles vector<string> and vector<number_t>
         // values, so the index of that vector is also required
         return std::visit([&](auto &&var) -> bool {
@@ -44,27 +92,32 @@ namespace amps
 
                 // make sure we're not accessing out of bounds item
                 if (index >= var.size()) {
-                    stack_push(object_t(std::string("")));
+                    stack_emplace(empty_string);
                     return false;
                 }
                 else {
-                    stack_push(object_t(var.at(index)));
+                    stack_emplace(var.at(index));
                 }
             }
 
             return true;
-        }, environment_[key]);
+        }, *data);
     }
 
-    bool context::stack_push_from_environment(const std::string &key,
-                                              const std::string &user_key)
+    bool context::stack_push_from_slot(size_t slot,
+                                       const std::string &user_key)
     {
-        if (key.size() == 0 || user_key.size() == 0) {
-            stack_push(object_t(std::string("")));
+        if (user_key.size() == 0) {
+            stack_emplace(empty_string);
             return false;
         }
 
-        // simply push the value of environment_[key] onto the stack
+        const user_var *data = slot_get_variable(slot);
+        if (data == nullptr) {
+            return true;
+        }
+
+        // simply push the value bound to the slot onto the stack
         // this method handles map<string, string> and map<string, number_t>
         // values, so the key of that map is also required
         return std::visit([&](auto &&var) -> bool {
@@ -74,154 +127,73 @@ namespace amps
                           std::is_same_v<T, m_string>) {
 
                 // make sure that the key exists
-                if (var.find(user_key) == var.end()) {
-                    stack_push(object_t(std::string("")));
+                auto it = var.find(user_key);
+                if (it == var.end()) {
+                    stack_emplace(empty_string);
                     return false;
                 }
                 else {
-                    stack_push(object_t(var[user_key]));
+                    stack_emplace(it->second);
                 }
             }
 
             return true;
-        }, environment_[key]);
-    }
-
-    void context::environment_add_or_update(const std::string &key,
-                                            const user_var &data)
-    {
-        if (environment_is_key_defined(key)) {
-            environment_[key] = data;
-            return;
-        }
-
-        environment_.insert(std::pair(key, data));
+        }, *data);
     }
 
-    void context::environment_add_or_update(const std::string &key,
-                                            const std::string &dest_key,
-                                            size_t index)
+    void context::environment_bind(const std::vector<std::string> &names)
     {
-        std::visit([&](auto &&var) {
-            using T = std::decay_t<decltype(var)>;
-
-            if constexpr (std::is_same_v<T, v_number> ||
-                          std::is_same_v<T, v_string>) {
-                environment_add_or_update(dest_key, var.at(index));
+        names_ = &names;
+        slots_.assign(names.size(), std::monostate());
+        locals_.assign(names.size(), nullptr);
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            auto it = overlay_.find(names[i]);
+            if (it != overlay_.end()) {
+                locals_[i] = &it->second;
+                slots_[i] = it->second;
             }
-        }, environment_[key]);
-    }
-
-    size_t context::environment_add_or_update(const std::string &key,
-                                              const std::string &dest_key,
-                                              const std::string &value,
-                                              size_t index)
-    {
-        std::string current_key = "";
-        auto it = environment_.find(dest_key);
-        if (it != environment_.end()) {
-            auto try_string = std::get_if<std::string>(&(it->second));
-            if (try_string != nullptr) {
-                current_key = *try_string;
+            else {
+                slots_[i] = environment_find(names[i]);
             }
         }
-
-        return std::visit([&](auto &&var) -> size_t {
-            using T = std::decay_t<decltype(var)>;
-
-            if constexpr (std::is_same_v<T, m_number> ||
-                          std::is_same_v<T, m_string>) {
-
-                if (index >= var.bucket_count()) {
-                    return 0;
-                }
-
-                // set the iterator to the next position based on
-                // the last key...
-                auto iter = var.begin(index);
-                if (current_key.size() > 0) {
-                    while (iter != var.end(index) && iter->first != current_key) {
-                        ++iter;
-                    }
-
-                    if (iter->first == current_key) {
-                        ++iter;
-                    }
-                }
-
-                // ...and look for the next item in hash after that
-                size_t idx = index;
-                for (; idx < var.bucket_count(); ++idx) {
-                    if (idx > index) {
-                        iter = var.begin(idx);
-                    }
-
-                    for (; iter != var.end(idx); ++iter) {
-                        if (iter->first.size() == 0) {
-                            continue;
-                        }
-
-                        environment_add_or_update(dest_key, iter->first);
-                        environment_add_or_update(value, iter->second);
-                        return idx;
-                    }
-                }
-
-                return idx;
-            }
-
-            return 0;
-        }, environment_[key]);
     }
 
     bool context::environment_check_value(const std::string &key,
                                           const user_var &value) const
     {
-        if (!environment_is_key_defined(key)) {
-            return false;
-        }
-
-        if (environment_.find(key)->second != value) {
-            return false;
-        }
-
-        return true;
+        return binding_equals(environment_find(key), value);
     }
 
     size_t context::environment_get_size(const std::string &key) const
     {
-        if (!environment_is_key_defined(key)) {
+        binding bind = environment_find(key);
+        auto var = std::get_if<const user_var*>(&bind);
+        if (var == nullptr) {
             return 0;
         }
 
-        return std::visit([](const auto var) -> size_t {
-            using T = std::decay_t<decltype(var)>;
-
-            if constexpr (std::is_same_v<T, v_number> ||
-                          std::is_same_v<T, v_string>) {
-                return var.size();
-            }
-            else if constexpr (std::is_same_v<T, m_number> ||
-                               std::is_same_v<T, m_string>) {
-                return var.bucket_count();
-            }
-
-            return 0;
-        }, environment_.find(key)->second);
+        return variable_size(**var);
     }
 
-    void context::environment_increment_value(const std::string &key)
+    size_t context::slot_get_size(size_t slot) const
     {
-        if (!environment_is_key_defined(key)) {
-            return;
+        const user_var *data = slot_get_variable(slot);
+        if (data == nullptr) {
+            return 0;
         }
 
-        std::visit([](auto &&var) {
-            using T = std::decay_t<decltype(var)>;
+        return variable_size(*data);
+    }
 
-            if constexpr (std::is_same_v<T, number_t>) {
-                var++;
-            }
-        }, environment_[key]);
+    void context::slot_erase(size_t slot)
+    {
+        // only variables created by the template can be erased, the
+        // user data they were shadowing (if any) is visible again
+        if (locals_[slot] != nullptr) {
+            overlay_.erase(slot_name(slot));
+            locals_[slot] = nullptr;
+            slots_[slot] = environment_find(slot_name(slot));
+        }
     }
 }
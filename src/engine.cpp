@@ -7,6 +7,11 @@
 #include <string>
 #include <any>
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
 using namespace std;
 
 namespace amps
@@ -15,12 +20,19 @@ namespace amps
         path_("."),
         error_(err),
         scanner_(err),
-        compiler_(err)
+        compiler_(err),
+        optimize_(false),
+        watch_fd_(-1)
     {
     }
 
     engine::~engine()
     {
+#ifdef __linux__
+        if (watch_fd_ >= 0) {
+            close(watch_fd_);
+        }
+#endif
     }
 
     void engine::set_template_directory(const string &path)
@@ -32,32 +44,245 @@ namespace amps
         path_ = path;
     }
 
+    void engine::set_optimize(bool optimize)
+    {
+        optimize_ = optimize;
+    }
+
     void engine::prepare_template(const string &name)
     {
-        std::string fullname = append(path_, name);
-        if (!is_readable_file(fullname)) {
-            return;
+        template_ptr tpl = load_template(name);
+        if (tpl) {
+            template_ = tpl;
         }
+    }
 
-        ifstream file(fullname);
-        if (!file.is_open()) {
+    template_ptr engine::load_template(const string &name)
+    {
+        auto file = load_file(append(path_, name));
+        if (file == nullptr) {
+            return nullptr;
+        }
+
+        scanner_.do_scan(file);
+        template_ptr tpl = scanner_.get_template(optimize_);
+        templates_[name] = tpl;
+        track(name, *tpl);
+        return tpl;
+    }
+
+    void engine::track(const string &name, const compiled_template &tpl)
+    {
+        // forget the files of the previous compilation of this template
+        for (auto it = dependents_.begin(); it != dependents_.end(); ) {
+            it->second.erase(name);
+            if (it->second.size() == 0) {
+                it = dependents_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        vector<string> files = {canonical_path(append(path_, name))};
+        for (const auto &dependency : tpl.get_dependencies()) {
+            files.push_back(canonical_path(dependency));
+        }
+
+        for (const auto &file : files) {
+            dependents_[file].insert(name);
+            if (watch_fd_ >= 0) {
+                watch_directory(parent_path(file));
+            }
+        }
+    }
+
+    void engine::watch_directory(const string &dir)
+    {
+#ifdef __linux__
+        int wd = inotify_add_watch(watch_fd_, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_TO | IN_MOVED_FROM);
+        if (wd < 0) {
+            error_.log("cannot watch directory ", dir);
             return;
         }
 
-        std::string content;
-        file.seekg(0, std::ios::end);
-        content.reserve(file.tellg());
-        file.seekg(0, std::ios::beg);
+        // watching the same directory again returns the same descriptor
+        watches_[wd] = dir;
+#else
+        (void)dir;
+#endif
+    }
+
+    bool engine::watch()
+    {
+#ifdef __linux__
+        if (watch_fd_ >= 0) {
+            return true;
+        }
+
+        watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd_ < 0) {
+            error_.log("cannot watch template files");
+            return false;
+        }
 
-        content.assign((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
+        watch_directory(canonical_path(path_));
+        for (const auto &dependency : dependents_) {
+            watch_directory(parent_path(dependency.first));
+        }
+
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    size_t engine::refresh()
+    {
+        if (watch_fd_ < 0) {
+            return 0;
+        }
+
+        unordered_set<string> changed;
+
+#ifdef __linux__
+        alignas(inotify_event) char buffer[4096];
+        for (;;) {
+            ssize_t len = read(watch_fd_, buffer, sizeof(buffer));
+            if (len <= 0) {
+                break;
+            }
+
+            for (ssize_t i = 0; i < len; ) {
+                auto event = reinterpret_cast<const inotify_event*>(buffer + i);
+                i += sizeof(inotify_event) + event->len;
+
+                auto dir = watches_.find(event->wd);
+                if (event->len == 0 || dir == watches_.end()) {
+                    continue;
+                }
+
+                // whatever was compiled from the file is stale, even a
+                // unit no prepared template inserts anymore
+                string path = canonical_path(append(dir->second, event->name));
+                scanner_.get_units().invalidate(path);
+
+                auto file = dependents_.find(path);
+                if (file != dependents_.end()) {
+                    changed.insert(file->second.begin(), file->second.end());
+                }
+            }
+        }
+#endif
+
+        // each template is compiled again once, however many of its
+        // files changed
+        for (const auto &name : changed) {
+            template_ptr previous = get_template(name);
+            template_ptr tpl = load_template(name);
+            if (tpl && previous == template_) {
+                template_ = tpl;
+            }
+        }
 
-        scanner_.do_scan(content);
-        compiler_.reset();
+        return changed.size();
     }
 
-    std::string engine::render(const user_map &um)
+    std::string engine::render(const user_map &um) const
     {
-        return compiler_.generate(scanner_.get_metainfo(), um);
+        if (!template_) {
+            return "";
+        }
+
+        return render(*template_, um);
+    }
+
+    std::string engine::render(const string &name,
+                               const user_map &um) const
+    {
+        auto tpl = get_template(name);
+        if (!tpl) {
+            return "";
+        }
+
+        return render(*tpl, um);
+    }
+
+    std::string engine::render(const compiled_template &tpl,
+                               const user_map &um) const
+    {
+        return compiler_.generate(tpl, um);
+    }
+
+    bool engine::render(const user_map &um, sink &out) const
+    {
+        if (!template_) {
+            return false;
+        }
+
+        return render(*template_, um, out);
+    }
+
+    bool engine::render(const string &name,
+                        const user_map &um,
+                        sink &out) const
+    {
+        auto tpl = get_template(name);
+        if (!tpl) {
+            return false;
+        }
+
+        return render(*tpl, um, out);
+    }
+
+    bool engine::render(const compiled_template &tpl,
+                        const user_map &um,
+                        sink &out) const
+    {
+        return compiler_.generate(tpl, um, out);
+    }
+
+    bool engine::render(const user_map &um, gather_output &out) const
+    {
+        if (!template_) {
+            out.clear();
+            return false;
+        }
+
+        bool complete = compiler_.generate(*template_, um, out);
+        out.keep_alive(template_);
+        return complete;
+    }
+
+    bool engine::render(const string &name,
+                        const user_map &um,
+                        gather_output &out) const
+    {
+        auto tpl = get_template(name);
+        if (!tpl) {
+            out.clear();
+            return false;
+        }
+
+        bool complete = compiler_.generate(*tpl, um, out);
+        out.keep_alive(tpl);
+        return complete;
+    }
+
+    template_ptr engine::get_template() const
+    {
+        return template_;
+    }
+
+    template_ptr engine::get_template(const string &name) const
+    {
+        auto it = templates_.find(name);
+        if (it == templates_.end()) {
+            return nullptr;
+        }
+
+        return it->second;
     }
 }
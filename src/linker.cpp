@@ -0,0 +1,234 @@
+#include "linker.h"
+#include "scan.h"
+#include "fileops.h"
+#include "optimizer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace amps
+{
+    // files is set to the files the unit was built from, with the stamps
+    // they had then (and still have)
+    shared_ptr<compiled_template> unit_cache::find(
+            const string &path,
+            bool optimized,
+            vector<pair<string, file_stamp>> &files)
+    {
+        auto it = units_.find(path);
+        if (it == units_.end()) {
+            return nullptr;
+        }
+
+        if (it->second.optimized != optimized) {
+            return nullptr;
+        }
+
+        for (const auto &file : it->second.files) {
+            if (stamp_file(file.first) != file.second) {
+                units_.erase(it);
+                return nullptr;
+            }
+        }
+
+        files = it->second.files;
+        return it->second.unit;
+    }
+
+    void unit_cache::add(const string &path,
+                         shared_ptr<compiled_template> unit,
+                         bool optimized,
+                         vector<pair<string, file_stamp>> &&files)
+    {
+        units_[path] = entry{std::move(unit), optimized, std::move(files)};
+    }
+
+    void unit_cache::invalidate(const string &path)
+    {
+        for (auto it = units_.begin(); it != units_.end(); ) {
+            const auto &files = it->second.files;
+            bool stale = any_of(files.begin(), files.end(),
+                                [&path](const auto &file) {
+                                    return file.first == path;
+                                });
+            if (stale) {
+                it = units_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    void unit_cache::clear()
+    {
+        units_.clear();
+    }
+
+    size_t unit_cache::size() const
+    {
+        return units_.size();
+    }
+
+    void linker::link(compiled_template &tpl, const string &path)
+    {
+        chain_.clear();
+        stamps_.clear();
+        link_unit(tpl, path);
+    }
+
+    // only what runs whatever the data counts: the text and the inserts
+    // outside any if or for. An opener left unmatched runs up to the end
+    // of the program, nothing after it counts
+    static size_t static_text_size(const compiled_template &tpl)
+    {
+        const program &prog = tpl.get_program();
+        const auto &links = tpl.get_links();
+        size_t depth = 0;
+        size_t total = 0;
+
+        for (const auto &ins : prog.code) {
+            switch (ins.op) {
+                case opcode::IF:
+                case opcode::FOR:
+                    ++depth;
+                    break;
+
+                case opcode::ENDIF:
+                case opcode::ENDFOR:
+                    if (depth > 0) {
+                        --depth;
+                    }
+                    break;
+
+                case opcode::TEXT:
+                    total += (depth == 0) ? ins.b : 0;
+                    break;
+
+                case opcode::STATIC:
+                    total += (depth == 0) ? prog.strings[ins.a].size() : 0;
+                    break;
+
+                case opcode::INCLUDE:
+                    if (depth == 0 && ins.b < links.size() &&
+                        links[ins.b].unit != nullptr) {
+                        total += links[ins.b].unit->static_size();
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        return total;
+    }
+
+    // every file the linker looked for, once, in the order they're found
+    void linker::add_dependency(compiled_template &tpl, const string &filename)
+    {
+        auto &files = tpl.dependencies_;
+        if (std::find(files.begin(), files.end(), filename) == files.end()) {
+            files.push_back(filename);
+        }
+    }
+
+    // false when an insert, here or in any inserted template, was cut
+    // by a cycle
+    bool linker::link_unit(compiled_template &tpl, const string &path)
+    {
+        const program &prog = tpl.program_;
+
+        if (optimize_) {
+            optimizer().optimize(tpl.metainfo_, tpl.program_);
+        }
+
+        bool complete = true;
+        chain_.push_back(path);
+        tpl.links_.clear();
+        tpl.dependencies_.clear();
+        for (size_t filename : prog.inserts) {
+            const string &name = prog.strings[filename];
+            tpl.links_.push_back(resolve(name, complete));
+            add_dependency(tpl, name);
+
+            const auto &unit = tpl.links_.back().unit;
+            if (unit != nullptr) {
+                for (const auto &dependency : unit->get_dependencies()) {
+                    add_dependency(tpl, dependency);
+                }
+            }
+        }
+        chain_.pop_back();
+
+        tpl.static_size_ = static_text_size(tpl);
+
+        return complete;
+    }
+
+    insert_link linker::resolve(const string &filename, bool &complete)
+    {
+        string path = canonical_path(filename);
+        auto in_chain = [this](const string &file) {
+            return std::find(chain_.begin(), chain_.end(), file) != chain_.end();
+        };
+
+        // an empty name, or one naming a directory, is never a template,
+        // even when it resolves to a file being linked
+        if (filename.empty() || !check_file(path).is_file) {
+            stamps_.emplace(path, stamp_file(path));
+            return insert_link{link_status::MISSING, nullptr};
+        }
+
+        // the chain holds the files being linked, one of them inserted
+        // again would insert itself forever
+        if (in_chain(path)) {
+            complete = false;
+            return insert_link{link_status::CYCLE, nullptr};
+        }
+
+        // a cached unit has been completely linked already, unless it
+        // inserts a file of the chain: linked from here that's a cycle
+        vector<pair<string, file_stamp>> files;
+        shared_ptr<compiled_template> unit = units_.find(path, optimize_, files);
+        if (unit != nullptr &&
+            none_of(files.begin(), files.end(),
+                    [&in_chain](const auto &file) {
+                        return in_chain(file.first);
+                    })) {
+            for (auto &file : files) {
+                stamps_.emplace(std::move(file.first), file.second);
+            }
+            return insert_link{link_status::LINKED, unit};
+        }
+
+        // stamped before it's read, a change while it's read leaves the
+        // unit stale rather than hides the change
+        stamps_.emplace(path, stamp_file(path));
+        auto file = load_file(filename);
+        if (file == nullptr) {
+            return insert_link{link_status::MISSING, nullptr};
+        }
+
+        scan unit_scan(error_);
+        unit_scan.do_scan(file);
+        unit = make_shared<compiled_template>(
+                std::move(unit_scan.get_metainfo()));
+
+        if (!link_unit(*unit, path)) {
+            complete = false;
+            return insert_link{link_status::LINKED, unit};
+        }
+
+        files.clear();
+        files.emplace_back(path, stamps_[path]);
+        for (const auto &dependency : unit->get_dependencies()) {
+            string dependency_path = canonical_path(dependency);
+            files.emplace_back(dependency_path, stamps_[dependency_path]);
+        }
+        units_.add(path, unit, optimize_, std::move(files));
+
+        return insert_link{link_status::LINKED, unit};
+    }
+}
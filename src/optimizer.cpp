@@ -0,0 +1,535 @@
+#include "optimizer.h"
+#include "compiler.h"
+#include "config.h"
+
+using namespace std;
+
+namespace amps
+{
+    void optimizer::optimize(const metainfo &info, program &prog)
+    {
+        program_ = &prog;
+        strings_.clear();
+        for (size_t i = 0; i < prog.strings.size(); ++i) {
+            strings_.emplace(prog.strings[i], i);
+        }
+
+        // every step works on the code compacted by the previous one,
+        // so the patterns they look for are always adjacent
+        keep_.assign(prog.code.size(), true);
+        fold_expressions();
+        compact();
+
+        fold_branches();
+        compact();
+
+        fold_prints();
+        compact();
+
+        merge_text(info);
+        compact();
+
+        // the inserts left are numbered again, in the order they run
+        prog.inserts.clear();
+        for (auto &ins : prog.code) {
+            if (ins.op == opcode::INCLUDE) {
+                prog.inserts.push_back(ins.a);
+                ins.b = prog.inserts.size() - 1;
+            }
+        }
+
+        program_ = nullptr;
+    }
+
+    size_t optimizer::intern(const string &str)
+    {
+        auto it = strings_.find(str);
+        if (it != strings_.end()) {
+            return it->second;
+        }
+
+        program_->strings.push_back(str);
+        strings_[str] = program_->strings.size() - 1;
+        return program_->strings.size() - 1;
+    }
+
+    bool optimizer::is_constant(const instruction &ins) const
+    {
+        return ins.op == opcode::PUSH_NUMBER ||
+               ins.op == opcode::PUSH_STRING ||
+               ins.op == opcode::PUSH_BOOL;
+    }
+
+    object_t optimizer::constant(const instruction &ins) const
+    {
+        if (ins.op == opcode::PUSH_NUMBER) {
+            return object_t(number_t(ins.a));
+        }
+        else if (ins.op == opcode::PUSH_STRING) {
+            return object_t(program_->strings[ins.a]);
+        }
+
+        return object_t(ins.a != 0);
+    }
+
+    instruction optimizer::make_constant(const object_t &value, uint32_t line)
+    {
+        switch (value.get_type()) {
+            case vobject_types::NUMBER:
+                return instruction{opcode::PUSH_NUMBER, token_types::EOT, line,
+                                   value.get_number_or(0), 0};
+
+            case vobject_types::STRING:
+                return instruction{opcode::PUSH_STRING, token_types::EOT, line,
+                                   intern(value.get_string_or("")), 0};
+
+            default:
+                return instruction{opcode::PUSH_BOOL, token_types::EOT, line,
+                                   value.get_bool_or(false) ? 1u : 0u, 0};
+        }
+    }
+
+    // the same text OUTPUT would print
+    string optimizer::constant_text(const object_t &value) const
+    {
+        string text;
+        value.print(text);
+        return text;
+    }
+
+    void optimizer::fold_expressions()
+    {
+        vector<instruction> &code = program_->code;
+
+        // the instructions kept so far, an operator is applied to the
+        // last ones. Expressions are complete, so when those are
+        // literals they're exactly its operands. Where an and/or jumps
+        // to, the value on the stack isn't known: nothing before it
+        // is folded with what follows
+        vector<size_t> live;
+        vector<bool> target(code.size() + 1, false);
+
+        for (const auto &ins : code) {
+            if (ins.op == opcode::JUMP_FALSE || ins.op == opcode::JUMP_TRUE) {
+                target[ins.a] = true;
+            }
+        }
+
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            instruction &ins = code[pc];
+
+            if (target[pc]) {
+                live.clear();
+            }
+            size_t count = live.size();
+
+            if (ins.op == opcode::BINARY && count >= 2 &&
+                is_constant(code[live[count - 2]]) &&
+                is_constant(code[live[count - 1]])) {
+                auto result = apply_binary(ins.oper,
+                                           constant(code[live[count - 2]]),
+                                           constant(code[live[count - 1]]));
+                if (result != nullopt) {
+                    ins = make_constant(result.value(), ins.line);
+                    keep_[live[count - 2]] = false;
+                    keep_[live[count - 1]] = false;
+                    live.resize(count - 2);
+                }
+            }
+            else if (ins.op == opcode::UNARY && count >= 1 &&
+                     is_constant(code[live[count - 1]])) {
+                auto result = apply_unary(ins.oper,
+                                          constant(code[live[count - 1]]));
+                if (result != nullopt) {
+                    ins = make_constant(result.value(), ins.line);
+                    keep_[live[count - 1]] = false;
+                    live.pop_back();
+                }
+            }
+            else if (ins.op == opcode::TO_BOOL && count >= 1 &&
+                     is_constant(code[live[count - 1]])) {
+                bool value = constant(code[live[count - 1]]).is_true();
+                ins = make_constant(object_t(value), ins.line);
+                keep_[live[count - 1]] = false;
+                live.pop_back();
+            }
+            else if ((ins.op == opcode::JUMP_FALSE ||
+                      ins.op == opcode::JUMP_TRUE) && count >= 1 &&
+                     is_constant(code[live[count - 1]])) {
+                instruction &left = code[live[count - 1]];
+                bool value = constant(left).is_true();
+                keep_[pc] = false;
+
+                // a literal deciding the result replaces the whole
+                // and/or, otherwise only the right side is left
+                if (value == (ins.op == opcode::JUMP_TRUE)) {
+                    left = make_constant(object_t(value), left.line);
+                    remove(pc, ins.a);
+                    pc = ins.a - 1;
+                }
+                else {
+                    keep_[live[count - 1]] = false;
+                    live.pop_back();
+                }
+                continue;
+            }
+            else if (ins.op == opcode::CHECK_NUMBER && count >= 1 &&
+                     code[live[count - 1]].op == opcode::PUSH_NUMBER) {
+                keep_[pc] = false;
+                continue;
+            }
+
+            live.push_back(pc);
+        }
+    }
+
+    void optimizer::fold_prints()
+    {
+        vector<instruction> &code = program_->code;
+
+        for (size_t pc = 0; pc + 2 < code.size(); ++pc) {
+            if (code[pc].op != opcode::PRINT ||
+                !is_constant(code[pc + 1]) ||
+                code[pc + 2].op != opcode::OUTPUT) {
+                continue;
+            }
+
+            string text = constant_text(constant(code[pc + 1]));
+            if (text.size() == 0) {
+                keep_[pc] = false;
+            }
+            else {
+                code[pc] = instruction{opcode::STATIC, token_types::EOT,
+                                       code[pc].line, intern(text), 0};
+            }
+
+            keep_[pc + 1] = false;
+            keep_[pc + 2] = false;
+            pc += 2;
+        }
+    }
+
+    void optimizer::fold_branches()
+    {
+        vector<instruction> &code = program_->code;
+
+        // outer chains first, whatever they drop is never looked at
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            if (code[pc].op == opcode::IF && keep_[pc]) {
+                fold_chain(pc);
+            }
+        }
+    }
+
+    // a block can be dropped, or run without its clause, only when
+    // every statement it opens is also closed inside it
+    bool optimizer::is_balanced(size_t from, size_t to) const
+    {
+        const vector<instruction> &code = program_->code;
+        size_t depth = 0;
+
+        for (size_t pc = from; pc < to; ++pc) {
+            if (!keep_[pc]) {
+                continue;
+            }
+
+            switch (code[pc].op) {
+                case opcode::IF:
+                case opcode::FOR:
+                    ++depth;
+                    break;
+
+                case opcode::ENDIF:
+                case opcode::ENDFOR:
+                    if (depth == 0) {
+                        return false;
+                    }
+                    --depth;
+                    break;
+
+                case opcode::ELIF:
+                case opcode::ELSE:
+                    if (depth == 0) {
+                        return false;
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        return depth == 0;
+    }
+
+    bool optimizer::clause_constant(size_t pc, bool &taken) const
+    {
+        const vector<instruction> &code = program_->code;
+
+        if (pc + 2 >= code.size() ||
+            !is_constant(code[pc + 1]) ||
+            code[pc + 2].op != opcode::TEST) {
+            return false;
+        }
+
+        taken = constant(code[pc + 1]).is_true();
+        return true;
+    }
+
+    void optimizer::remove(size_t from, size_t to)
+    {
+        for (size_t pc = from; pc < to; ++pc) {
+            keep_[pc] = false;
+        }
+    }
+
+    void optimizer::fold_chain(size_t pc)
+    {
+        vector<instruction> &code = program_->code;
+        vector<size_t> clauses{pc};
+        size_t end = npos;
+
+        // follow the clauses matched by the assembler up to the endif,
+        // an if that isn't closed is left as it is
+        while (end == npos) {
+            const instruction &ins = code[clauses.back()];
+            size_t next = ins.a;
+
+            if (next >= code.size()) {
+                return;
+            }
+
+            if (ins.op == opcode::ELSE || code[next].op == opcode::ENDIF) {
+                end = next;
+            }
+            else if (code[next].op == opcode::ELIF ||
+                     code[next].op == opcode::ELSE) {
+                clauses.push_back(next);
+            }
+            else {
+                return;
+            }
+        }
+
+        if (code[end].op != opcode::ENDIF) {
+            return;
+        }
+
+        for (size_t i = 0; i < clauses.size(); ++i) {
+            size_t next = (i + 1 < clauses.size()) ? clauses[i + 1] : end;
+            if (!is_balanced(clauses[i] + 1, next)) {
+                return;
+            }
+        }
+
+        // a clause is dropped when it can't be taken, the first one that
+        // is always taken ends the chain. The clauses left shift up, the
+        // first one is the new if
+        bool first = true;
+        for (size_t i = 0; i < clauses.size(); ++i) {
+            size_t at = clauses[i];
+            size_t next = (i + 1 < clauses.size()) ? clauses[i + 1] : end;
+            instruction &ins = code[at];
+            bool taken = false;
+
+            if (!keep_[at]) {
+                continue;
+            }
+
+            if (ins.op == opcode::ELSE) {
+                if (first) {
+                    keep_[at] = false;
+                    keep_[end] = false;
+                }
+                return;
+            }
+
+            if (!clause_constant(at, taken)) {
+                if (first && ins.op == opcode::ELIF) {
+                    ins.op = opcode::IF;
+                }
+                first = false;
+                continue;
+            }
+
+            if (!taken) {
+                remove(at, next);
+                continue;
+            }
+
+            remove(at + 1, at + 3);
+            if (first) {
+                keep_[at] = false;
+                remove(next, end + 1);
+            }
+            else {
+                ins.op = opcode::ELSE;
+                ins.a = end;
+                remove(next, end);
+            }
+            return;
+        }
+
+        // no clause left at all
+        if (first) {
+            keep_[end] = false;
+        }
+    }
+
+    void optimizer::merge_text(const metainfo &info)
+    {
+        vector<instruction> &code = program_->code;
+        const vector<size_t> &entries = program_->entries;
+        vector<bool> target(code.size() + 1, false);
+
+        // text can't be merged into text the code jumps to
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            const instruction &ins = code[pc];
+
+            switch (ins.op) {
+                case opcode::ELIF:
+                    target[ins.b] = true;
+                    [[fallthrough]];
+
+                case opcode::IF:
+                case opcode::ELSE:
+                case opcode::FOR:
+                case opcode::JUMP_FALSE:
+                case opcode::JUMP_TRUE:
+                    target[ins.a] = true;
+                    break;
+
+                case opcode::LOOP_RANGE:
+                case opcode::LOOP_EACH:
+                case opcode::LOOP_PAIRS:
+                    target[pc + 1] = true;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        // nor into the text an error in the code before it jumps to
+        for (size_t i = 1; i < entries.size(); ++i) {
+            for (size_t pc = entries[i - 1]; pc < entries[i]; ++pc) {
+                if (code[pc].op != opcode::TEXT &&
+                    code[pc].op != opcode::STATIC) {
+                    target[entries[i]] = true;
+                    break;
+                }
+            }
+        }
+
+        auto is_text = [&](size_t pc) {
+            return code[pc].op == opcode::TEXT || code[pc].op == opcode::STATIC;
+        };
+
+        auto view = [&](size_t pc) {
+            const instruction &ins = code[pc];
+            if (ins.op == opcode::TEXT) {
+                return string_view(info[ins.a].data.data(), ins.b);
+            }
+            return string_view(program_->strings[ins.a]);
+        };
+
+        // text next to it in the source only extends the slice, anything
+        // else is joined in a copy. Only pieces shorter than a segment are
+        // copied, the text of the template stays where it is
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            size_t last = pc + 1;
+            if (!is_text(pc)) {
+                continue;
+            }
+
+            while (last < code.size() && is_text(last) && !target[last]) {
+                ++last;
+            }
+
+            size_t at = pc;
+            string joined;
+            bool copied = false;
+
+            auto flush = [&]() {
+                if (copied) {
+                    code[at] = instruction{opcode::STATIC, token_types::EOT,
+                                           code[at].line, intern(joined), 0};
+                }
+            };
+
+            for (size_t i = pc + 1; i < last; ++i) {
+                string_view text = copied ? string_view(joined) : view(at);
+                string_view next = view(i);
+
+                if (!copied && code[at].op == opcode::TEXT &&
+                    code[i].op == opcode::TEXT &&
+                    text.data() + text.size() == next.data()) {
+                    code[at].b += next.size();
+                }
+                else if ((copied || text.size() < MIN_SEGMENT_SZ) &&
+                         next.size() < MIN_SEGMENT_SZ) {
+                    if (!copied) {
+                        joined.assign(text);
+                        copied = true;
+                    }
+                    joined.append(next);
+                }
+                else {
+                    flush();
+                    at = i;
+                    joined.clear();
+                    copied = false;
+                    continue;
+                }
+
+                keep_[i] = false;
+            }
+
+            flush();
+            pc = last - 1;
+        }
+    }
+
+    void optimizer::compact()
+    {
+        vector<instruction> &code = program_->code;
+
+        // a dropped instruction is replaced by the next one kept, so
+        // jumps to it still land where the code would have continued
+        vector<size_t> moved(code.size() + 1);
+        size_t count = 0;
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            moved[pc] = count;
+            if (keep_[pc]) {
+                code[count++] = code[pc];
+            }
+        }
+        moved[code.size()] = count;
+        code.resize(count);
+
+        for (auto &ins : code) {
+            switch (ins.op) {
+                case opcode::ELIF:
+                    ins.b = moved[ins.b];
+                    [[fallthrough]];
+
+                case opcode::IF:
+                case opcode::ELSE:
+                case opcode::FOR:
+                case opcode::JUMP_FALSE:
+                case opcode::JUMP_TRUE:
+                    ins.a = moved[ins.a];
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        for (auto &entry : program_->entries) {
+            entry = moved[entry];
+        }
+
+        keep_.assign(code.size(), true);
+    }
+}
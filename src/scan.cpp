@@ -1,6 +1,10 @@
 #include "scan.h"
+#include "simd.h"
+#include "linker.h"
 #include "config.h"
 
+#include <limits>
+
 using namespace std;
 
 namespace amps
@@ -8,23 +12,44 @@ namespace amps
     scan::scan(error &err)
         : error_(err)
     {
-        // KEYWORDS are defined in token.h
-        // this X-Macro adds each defined keyword into the map
-        keywords_ = {
-        #define X(kw, name) {kw, token_types::name},
-            KEYWORDS
-        #undef X
-        };
+    }
+
+    // hands the scanned metainfo over to an immutable compiled template,
+    // with its inserts already linked. The scanner is left empty until
+    // the next do_scan
+    template_ptr scan::get_template(bool optimize)
+    {
+        auto tpl = make_shared<compiled_template>(std::move(metainfo_));
+        linker(error_, units_, optimize).link(*tpl, file_);
+        return tpl;
     }
 
     void scan::do_scan(const string &content)
+    {
+        // the metadata refer to the template owned copy of the content
+        auto source = make_shared<const string>(content);
+        do_scan(source, *source);
+    }
+
+    // a template read from a file is known by its path, inserting it
+    // back from one of its inserts is a cycle
+    void scan::do_scan(const shared_ptr<const file_content> &file)
+    {
+        do_scan(file, file->view());
+        file_ = file->path();
+    }
+
+    void scan::do_scan(shared_ptr<const void> owner, string_view content)
     {
         line_ = 0;
+        file_.clear();
         metainfo_.clear();
+        metainfo_.set_hash(content_hash(content));
+        metainfo_.set_source(std::move(owner), content);
         parse_block(content);
     }
 
-    void scan::parse_block(const string &content)
+    void scan::parse_block(string_view content)
     {
         for (size_t i = 0; i < content.size(); ++i) {
             metadata mtdt;
@@ -38,23 +63,54 @@ namespace amps
                 mtdt = text_block(content, i, false);
             }
 
-            metainfo_.add_metadata(mtdt);
-
-            // text blocks don't require special treatment
+            // text blocks don't require special treatment, text next to
+            // text is rendered as it is anyway, so the whole stretch up
+            // to the next code block is kept as a single segment
+            // NOTE: blank text is dropped, a stretch with a blank line
+            //       in the middle isn't contiguous in the content anymore
+            //       and is joined in a copy kept by the metainfo
             if (mtdt.type == metatype::TEXT) {
+                if (mtdt.data.size() == 0) {
+                    continue;
+                }
+
+                if (metainfo_.size() > 0 &&
+                    metainfo_.back().type == metatype::TEXT) {
+                    metadata &text = metainfo_.back();
+                    if (text.data.data() + text.data.size() == mtdt.data.data()) {
+                        text.data = string_view(text.data.data(),
+                                                text.data.size() + mtdt.data.size());
+                    }
+                    else {
+                        text.data = metainfo_.join(text.data, mtdt.data);
+                    }
+                    text.range.end = mtdt.range.end;
+                }
+                else {
+                    metainfo_.add_metadata(std::move(mtdt));
+                }
                 continue;
             }
 
+            metainfo_.add_metadata(std::move(mtdt));
+
             // on the other hand, code blocks is scanned and
             // tokenized into metainfo
             // NOTE: code block will be reverted to text block
             //       if it finds any issue during this phase
-            scan_iterator it(mtdt.data);
-            scan_code(it, metainfo_.back());
+            metadata &code = metainfo_.back();
+
+            // {= expression =} is an alias to {% print expression %}
+            if (code.type == metatype::ECHO) {
+                code.add_token(token_t(token_types::PRINT));
+            }
+
+            scan_iterator it(code.data);
+            scan_code(it, code);
         }
     }
 
-    metadata scan::code_block(const string &content,
+    metadata scan::code_block(string_view content,
                               size_t &position)
     {
         // a valid code block must respect the following layout
@@ -64,7 +120,6 @@ namespace amps
         // IMPORTANT: empty space between opening and closing tags
 
         metadata metadata = {
-            0,
             metatype::CODE,
             {position, position, line_},
             "",
@@ -96,62 +151,64 @@ namespace amps
 
         position = ++confirm_code;
         while (position < content.size()) {
-            if (content[position] == '\n') {
-                line_++;
+
+            // don't stop searching until we find the closing pattern,
+            // lines in between are counted in bulk
+            size_t close = position + simd::find_any(
+                    content.data() + position, content.size() - position,
+                    TAG_CLSE, TAG_CLSE);
+            line_ += simd::count(content.data() + position,
+                                 close - position, '\n');
+            position = close;
+
+            if (position == content.size()) {
+                break;
             }
 
-            // don't stop searching until we find the closing pattern
-            if (content[position] == TAG_CLSE) {
-                if (metadata.type == metatype::ECHO &&
-                    content[position - 1] == TAG_ECHO &&
-                    content[position - 2] == ' ') {
-                        break;
-                }
-                else if (metadata.type == metatype::CODE &&
-                    content[position - 1] == TAG_CODE &&
-                    content[position - 2] == ' ') {
-                        break;
-                }
+            if (metadata.type == metatype::ECHO &&
+                content[position - 1] == TAG_ECHO &&
+                content[position - 2] == ' ') {
+                    break;
+            }
+            else if (metadata.type == metatype::CODE &&
+                content[position - 1] == TAG_CODE &&
+                content[position - 2] == ' ') {
+                    break;
+            }
 
-                // any closing match problem
-                //   i.e. {%  =} or {=  %}
-                // is invalid, the whole content will be handled
-                // as common text
-                else if (content[position - 1] == TAG_ECHO) {
-                    error_.critical("expects % ",
-                                    line_, " ",
-                                    metadata.range.start, " ",
-                                    position);
-                    position = confirm_code - 3;
-                    return text_block(content, position, true);
-                }
-                else if (content[position - 1] == TAG_CODE) {
-                    error_.critical("expects = ",
-                                    line_, " ",
-                                    metadata.range.start, " ",
-                                    position);
-                    position = confirm_code - 3;
-                    return text_block(content, position, true);
-                }
+            // any closing match problem
+            //   i.e. {%  =} or {=  %}
+            // is invalid, the whole content will be handled
+            // as common text
+            else if (content[position - 1] == TAG_ECHO) {
+                error_.critical("expects % ",
+                                line_, " ",
+                                metadata.range.start, " ",
+                                position);
+                position = confirm_code - 3;
+                return text_block(content, position, true);
+            }
+            else if (content[position - 1] == TAG_CODE) {
+                error_.critical("expects = ",
+                                line_, " ",
+                                metadata.range.start, " ",
+                                position);
+                position = confirm_code - 3;
+                return text_block(content, position, true);
             }
             ++position;
         }
 
         // line ended without a closing =} or %}
-        if (content[position] != '}') {
-            position = confirm_code - 2;
+        if (position >= content.size() || content[position] != '}') {
+            position = confirm_code - 3;
             return text_block(content, position, true);
         }
 
-        // {= expression =} is an alias to {% print expression %}
         metadata.range.line = line_;
         metadata.range.end = position;
-        if (metadata.type == metatype::ECHO) {
-            metadata.data = "print ";
-        }
-
-        metadata.data += content.substr(confirm_code,
-                                        position - confirm_code - 2);
+        metadata.data = content.substr(
+                confirm_code, position - confirm_code - 2);
 
         if (metadata.type == metatype::CODE) {
             if (position + 1 < content.size() &&
@@ -164,12 +221,16 @@ namespace amps
         return metadata;
     }
 
-    metadata scan::text_block(const string &content,
+    // text up to the next tag opener or the end of the line. Text made
+    // only of spaces and tabs is blank and comes back empty, so it's
+    // dropped: a blank line is removed with its newline and so is the
+    // indentation of a code block. An empty line is kept as its newline,
+    // and so is the indentation of an echo, it's part of what's printed
+    metadata scan::text_block(string_view content,
                               size_t &position,
                               bool force)
     {
         metadata metadata = {
-            0,
             metatype::TEXT,
             {position, position, line_},
             "",
@@ -180,27 +241,26 @@ namespace amps
         bool is_echo = false;
         size_t initial = position;
 
+        // a code block that turned out to be text, skip its '{'
         if (force) {
             position++;
-            if (initial > 0) {
-                --metadata.range.start;
-                --initial;
-            }
         }
 
-        while (position < content.size() && (content[position] != '{')) {
-            if (content[position] == '\n') {
-                line_++;
-                break;
-            }
+        // text goes until the next tag opener or the end of the line
+        if (position < content.size()) {
+            const char *text = content.data() + position;
+            size_t len = simd::find_any(text, content.size() - position,
+                                        TAG_OPEN, '\n');
+
+            is_blank = (simd::find_other(text, len, ' ', '\t') == len);
+            position += len;
 
-            if (content[position] != ' ' && content[position] != '\t') {
-                is_blank = false;
+            if (position < content.size() && content[position] == '\n') {
+                line_++;
             }
-            ++position;
         }
 
-        if (content[position] == '{') {
+        if (position < content.size() && content[position] == '{') {
             if (position + 1 < content.size() &&
                 content[position + 1] == '=') {
                 is_echo = true;
@@ -217,7 +277,8 @@ namespace amps
         else {
             metadata.range.line = line_;
             metadata.range.end = position;
-            metadata.data = content.substr(initial, position - initial + 1);
+            metadata.data = content.substr(
+                    initial, position - initial + 1);
         }
 
         return metadata;
@@ -291,12 +352,12 @@ namespace amps
             return;
         }
 
-        string str = (len == 0) ? "" : it.substr(start, len);
-        data.add_token(token_t(token_types::STRING, str));
+        data.add_token(token_t(token_types::STRING, start, len));
     }
 
     void scan::parse_number(const scan_iterator &it, metadata &data)
     {
+        size_t start = it.cursor();
         unsigned long int number = 0;
 
         while (!it.is_eol() && isdigit(it.look())) {
@@ -312,8 +373,8 @@ namespace amps
             number = number * 10 + digit;
         }
 
-        data.add_token(token_t(token_types::NUMBER,
-                                         to_string(number)));
+        data.add_token(token_t(token_types::NUMBER, start,
+                               it.cursor() - start));
     }
 
     void scan::parse_id(const scan_iterator &it, metadata &data)
@@ -333,12 +394,12 @@ namespace amps
             it.next();
         }
 
-        const string &text = it.substr(start, len);
-        if (keywords_.find(text) != keywords_.end()) {
-            data.add_token(token_t(keywords_[text]));
+        token_types type = get_keyword(it.substr(start, len));
+        if (type != token_types::IDENTIFIER) {
+            data.add_token(token_t(type));
         }
         else {
-            data.add_token(token_t(token_types::IDENTIFIER, text));
+            data.add_token(token_t(token_types::IDENTIFIER, start, len));
         }
     }
 }
@@ -2,19 +2,24 @@
 
 namespace amps
 {
-    token_t::token_t()
+    token_t::token_t() :
+        type_(token_types::EOT),
+        offset_(0),
+        length_(0)
     {
     }
 
-    token_t::token_t(token_types type, value_t value) :
+    token_t::token_t(token_types type, size_t offset, size_t length) :
         type_(type),
-        value_(value)
+        offset_(static_cast<uint32_t>(offset)),
+        length_(static_cast<uint32_t>(length))
     {
     }
 
     token_t::token_t(token_types type) :
         type_(type),
-        value_({})
+        offset_(0),
+        length_(0)
     {
     }
 }
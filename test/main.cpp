@@ -4,6 +4,7 @@
 
 #include "test_scan.h"
 #include "test_compiler.h"
+#include "test_engine.h"
 
 using namespace std;
 
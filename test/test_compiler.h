@@ -5,10 +5,12 @@
 
 #include <string>
 #include <array>
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #ifndef DEBUG
     #define disable_stdout(fn)                       \
@@ -37,25 +39,17 @@ protected:
 
     void set_file(const std::string &filename)
     {
-        std::ifstream file(filename);
-        std::string content;
-        file.seekg(0, std::ios::end);
-        content.reserve(file.tellg());
-        file.seekg(0, std::ios::beg);
-
-        content.assign((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-        scan_.do_scan(content);
+        scan_.do_scan(amps::load_file(filename));
     }
 
     std::string compile()
     {
-        return compiler_.generate(scan_.get_metainfo(), amps::user_map {{"", ""}});
+        return compiler_.generate(*scan_.get_template(), amps::user_map {{"", ""}});
     }
 
     std::string compile(const amps::user_map &usermap)
     {
-        return compiler_.generate(scan_.get_metainfo(), usermap);
+        return compiler_.generate(*scan_.get_template(), usermap);
     }
 
     void SetUp() override
@@ -84,7 +78,7 @@ TEST_F (compiler_test, valid_for_range)
     int64_t step = 0;
     compiler_.set_callback([&step](const context &ctx,
                                    const vector<branch> &branches) {
-        EXPECT_THAT(ctx.environment_check_value("val", step++), true);
+        EXPECT_THAT(ctx.environment_check_value("val", static_cast<amps::number_t>(step++)), true);
         EXPECT_THAT(branches.back().type, amps::token_types::FOR);
         EXPECT_THAT(branches.back().taken, true);
     });
@@ -103,7 +97,7 @@ TEST_F (compiler_test, valid_for_range_neg)
     int64_t step = -6;
     compiler_.set_callback([&step](const context &ctx,
                                    const vector<branch> &branches) {
-        EXPECT_THAT(ctx.environment_check_value("ident", step), true);
+        EXPECT_THAT(ctx.environment_check_value("ident", static_cast<amps::number_t>(step)), true);
         EXPECT_THAT(branches.back().type, amps::token_types::FOR);
         EXPECT_THAT(branches.back().taken, true);
         step += 2;
@@ -123,7 +117,7 @@ TEST_F (compiler_test, valid_for_range_reverse)
     int64_t step = 10;
     compiler_.set_callback([&step](const context &ctx,
                                    const vector<branch> &branches) {
-        EXPECT_THAT(ctx.environment_check_value("blah", step--), true);
+        EXPECT_THAT(ctx.environment_check_value("blah", static_cast<amps::number_t>(step--)), true);
         EXPECT_THAT(branches.back().type, amps::token_types::FOR);
         EXPECT_THAT(branches.back().taken, true);
     });
@@ -172,7 +166,7 @@ TEST_F (compiler_test, nested_range)
     compiler_.set_callback([&step1, &step2](const context &ctx,
                                             const vector<branch> &branches) {
         if (ctx.environment_is_key_defined("bleh")) {
-            EXPECT_THAT(ctx.environment_check_value("bleh", step2++), true);
+            EXPECT_THAT(ctx.environment_check_value("bleh", static_cast<amps::number_t>(step2++)), true);
             EXPECT_THAT(branches.back().type, amps::token_types::FOR);
             EXPECT_THAT(branches.back().taken, true);
         }
@@ -182,7 +176,7 @@ TEST_F (compiler_test, nested_range)
             EXPECT_THAT(branches.back().type, amps::token_types::FOR);
             EXPECT_THAT(branches.back().taken, true);
         }
-        EXPECT_THAT(ctx.environment_check_value("blah", step1), true);
+        EXPECT_THAT(ctx.environment_check_value("blah", static_cast<amps::number_t>(step1)), true);
     });
 
     disable_stdout(compile());
@@ -881,3 +875,691 @@ TEST_F (compiler_test, test_print)
 
     disable_stdout(compile());
 }
+
+TEST_F (compiler_test, test_shared_template)
+{
+    using amps::number_t;
+    using amps::user_map;
+    using std::unordered_map;
+    using std::vector;
+    using std::string;
+
+    set_file("code.insert.2");
+    amps::template_ptr program = scan_.get_template();
+
+    unordered_map<string, number_t> ages = {{"John", 53}};
+    vector<number_t> random_nrs = {3, 12, 8};
+    user_map um {{"ages", ages}, {"nums", random_nrs}};
+
+    // the same compiled template rendered by many threads at once
+    string expected = compiler_.generate(*program, um);
+    vector<string> rendered(4);
+    vector<std::thread> workers;
+    for (size_t i = 0; i < rendered.size(); ++i) {
+        workers.emplace_back([&, i]() {
+            rendered[i] = compiler_.generate(*program, um);
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    for (const auto &result : rendered) {
+        EXPECT_THAT(result, expected);
+    }
+    EXPECT_THAT(expected, testing::HasSubstr("I'm inserted 2"));
+}
+
+TEST_F (compiler_test, test_bytecode)
+{
+    using amps::opcode;
+    using amps::token_types;
+
+    scan_.do_scan("{= 5 * (2 + val) =}{% if size( %}");
+    amps::template_ptr program = scan_.get_template();
+    const auto &prog = program->get_program();
+
+    std::vector<opcode> expected = {
+        opcode::PRINT, opcode::PUSH_NUMBER, opcode::PUSH_NUMBER,
+        opcode::LOAD, opcode::BINARY, opcode::BINARY, opcode::OUTPUT,
+        opcode::IF, opcode::FAIL,
+    };
+
+    ASSERT_THAT(prog.code.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_THAT(prog.code[i].op, expected[i]);
+    }
+
+    EXPECT_THAT(prog.entries, testing::ElementsAre(0, 7, 9));
+    EXPECT_THAT(prog.code[1].a, 5);
+    EXPECT_THAT(prog.code[4].oper, token_types::PLUS);
+    EXPECT_THAT(prog.code[5].oper, token_types::STAR);
+    EXPECT_THAT(prog.slots[prog.code[3].a], "val");
+
+    // syntax errors are only reported when the statement runs
+    EXPECT_THAT(error_.get_first_error_msg(), "");
+    disable_stdout(compiler_.generate(*program, amps::user_map {{"val", amps::number_t(1)}}));
+    EXPECT_THAT(error_.get_first_error_msg(), "Error: no token found. Line: 0");
+}
+
+TEST_F (compiler_test, test_jump_targets)
+{
+    using amps::opcode;
+
+    scan_.do_scan("{% if false %}{% if false %}{% else %}A{% endif %}"
+                  "{% elif true %}B{% else %}C{% endif %}"
+                  "{% for i in range(0, 0, 1) %}{= i =}{% endfor %}D");
+    amps::template_ptr program = scan_.get_template();
+    const auto &code = program->get_program().code;
+
+    auto at = [&code](size_t pc) {
+        return code[pc].op;
+    };
+
+    // outer if -> elif -> else -> endif
+    ASSERT_THAT(at(0), opcode::IF);
+    ASSERT_THAT(at(code[0].a), opcode::ELIF);
+    ASSERT_THAT(at(code[code[0].a].a), opcode::ELSE);
+    ASSERT_THAT(at(code[code[0].a].b), opcode::ENDIF);
+    ASSERT_THAT(code[code[code[0].a].a].a, code[code[0].a].b);
+
+    // inner if -> else -> endif, nested inside the outer if
+    ASSERT_THAT(at(3), opcode::IF);
+    ASSERT_THAT(at(code[3].a), opcode::ELSE);
+    ASSERT_THAT(at(code[code[3].a].a), opcode::ENDIF);
+    EXPECT_LT(code[code[3].a].a, code[0].a);
+
+    // for -> endfor
+    size_t pc = 0;
+    while (at(pc) != opcode::FOR) {
+        ++pc;
+    }
+    ASSERT_THAT(at(code[pc].a), opcode::ENDFOR);
+
+    // the loop bookkeeping variables are slots too
+    EXPECT_THAT(program->get_program().slots,
+                testing::IsSupersetOf({"i", "i_idx"}));
+
+    int64_t calls = 0;
+    compiler_.set_callback([&calls](const amps::context &,
+                                    const std::vector<amps::branch> &) {
+        ++calls;
+    });
+
+    // the else of a skipped if is never reached, neither is the print
+    // of an empty loop
+    EXPECT_THAT(compiler_.generate(*program, amps::user_map {{"", ""}}), "BD");
+    EXPECT_THAT(error_.get_first_error_msg(), "");
+
+    // outer test, elif test and the endfor of the empty loop
+    EXPECT_THAT(calls, 3);
+}
+
+TEST_F (compiler_test, test_borrowed_environment)
+{
+    using amps::user_map;
+    using amps::number_t;
+    using std::vector;
+    using std::string;
+
+    scan_.do_scan("{% for i in vec %}{= i =}{= i_idx =}-{% endfor %}{= i_idx =}");
+
+    // loop variables live on top of the user data, without touching it
+    user_map um {{"vec", vector<string>{"a", "b"}}, {"i_idx", number_t(7)}};
+    EXPECT_THAT(compile(um), "a0-b1-7");
+    EXPECT_THAT(std::get<number_t>(um["i_idx"]), 7);
+    EXPECT_THAT(um.size(), 2);
+}
+
+TEST_F (compiler_test, test_map_iteration)
+{
+    using amps::user_map;
+    using amps::number_t;
+    using std::unordered_map;
+    using std::string;
+
+    scan_.do_scan("{% for k, v in none %}{= v =},{% endfor %}"
+                  "{% for k, v in small %}{= v =},{% endfor %}"
+                  "{= size(none) =} {= size(small) =} {= size(big) =}");
+
+    unordered_map<string, number_t> none;
+    unordered_map<string, number_t> small;
+    unordered_map<string, number_t> big;
+    for (number_t i = 0; i < 10000; ++i) {
+        if (i < 100) {
+            small["key" + std::to_string(i)] = i;
+        }
+        big["key" + std::to_string(i)] = i;
+    }
+
+    // size() counts entries, whatever the bucket count of the map is
+    none.reserve(64);
+    ASSERT_NE(small.bucket_count(), small.size());
+
+    string rendered = compile(user_map {{"none", none},
+                                        {"small", small},
+                                        {"big", big}});
+
+    // every entry is visited exactly once
+    std::vector<bool> seen(100, false);
+    std::istringstream values(rendered.substr(0, rendered.rfind(',')));
+    for (string value; std::getline(values, value, ',');) {
+        size_t idx = std::stoul(value);
+        ASSERT_LT(idx, seen.size());
+        EXPECT_FALSE(seen[idx]);
+        seen[idx] = true;
+    }
+
+    EXPECT_THAT(std::count(seen.begin(), seen.end(), true), 100);
+    EXPECT_THAT(rendered.substr(rendered.rfind(',') + 1), "0 100 10000");
+}
+
+TEST_F (compiler_test, test_loop_frames)
+{
+    using amps::user_map;
+    using std::vector;
+    using std::string;
+
+    // errors inside the body clear the expression stack, the loop
+    // state isn't kept there and survives them
+    scan_.do_scan("{% for x in vec %}{% for y in range(0, 2, 1) %}"
+                  "{= nope =}{= x =}{= y =}{% endfor %}{% endfor %}");
+
+    user_map um {{"vec", vector<string>{"a", "b"}}};
+    EXPECT_THAT(compile(um), "<null>a0<null>a1<null>b0<null>b1");
+    EXPECT_THAT(error_.get_first_error_msg(), "");
+}
+
+TEST_F (compiler_test, test_lazy_range)
+{
+    scan_.do_scan("{% for i in range(0, 100, 1) %}{% endfor %}"
+                  "{% for i in range(0, 101, 1) %}{% endfor %}"
+                  "{% for i in range(0, 1000, 10) %}{% endfor %}"
+                  "{% for i in range(0, 2000000000, 1) %}{% endfor %}"
+                  "{% for i in range(-5, -200, -2) %}{% endfor %}"
+                  "{% for i in range(7, 3, -3) %}{= i =},{% endfor %}");
+
+    // loops taken call back once per item (and once per print), the
+    // others only once from their endfor
+    size_t iterations = 0;
+    size_t skipped = 0;
+    compiler_.set_callback([&](const amps::context &,
+                               const std::vector<amps::branch> &branches) {
+        branches.back().taken ? ++iterations : ++skipped;
+    });
+
+    EXPECT_THAT(compile(), "7,4,");
+    EXPECT_THAT(skipped, 2);
+    EXPECT_THAT(iterations, 100 + 100 + 98 + 2 + 2);
+}
+
+TEST_F (compiler_test, test_linked_inserts)
+{
+    using amps::link_status;
+
+    // code.insert.5 is inserted twice and inserts code.insert.6, which
+    // the root inserts as well: every file is compiled once
+    set_file("code.insert.4");
+    amps::template_ptr root = scan_.get_template();
+    const auto &links = root->get_links();
+    ASSERT_EQ(links.size(), 3);
+    EXPECT_EQ(links[0].status, link_status::LINKED);
+    EXPECT_EQ(links[0].unit, links[1].unit);
+    ASSERT_EQ(links[0].unit->get_links().size(), 1);
+    EXPECT_EQ(links[0].unit->get_links()[0].unit, links[2].unit);
+
+    // code.insert.recursive1 inserts code.insert.3 back
+    set_file("code.insert.3");
+    amps::template_ptr cycle = scan_.get_template();
+    ASSERT_EQ(cycle->get_links().size(), 2);
+    const auto &unit = cycle->get_links()[0];
+    EXPECT_EQ(unit.status, link_status::LINKED);
+    EXPECT_EQ(unit.unit->get_links()[0].status, link_status::CYCLE);
+    EXPECT_EQ(unit.unit->get_links()[0].unit, nullptr);
+
+    // files are read when linking, rendering doesn't touch them
+    {
+        std::ofstream out("code.insert.linked");
+        out << "linked {= value =}";
+    }
+    scan_.do_scan("{% insert \"code.insert.linked\" %}|"
+                  "{% insert \"code.insert.missing\" %}");
+    amps::template_ptr linked = scan_.get_template();
+    std::remove("code.insert.linked");
+
+    EXPECT_EQ(linked->get_links()[1].status, link_status::MISSING);
+
+    // neither an empty name nor a directory is a template
+    {
+        std::ofstream out("code.insert.empty");
+        out << "{% insert \"\" %}|{% insert \".\" %}";
+    }
+    set_file("code.insert.empty");
+    amps::template_ptr empty = scan_.get_template();
+    std::remove("code.insert.empty");
+
+    ASSERT_EQ(empty->get_links().size(), 2);
+    EXPECT_EQ(empty->get_links()[0].status, link_status::MISSING);
+    EXPECT_EQ(empty->get_links()[1].status, link_status::MISSING);
+
+    scan_.do_scan("{% insert \"\" %}");
+    amps::template_ptr unnamed = scan_.get_template();
+    ASSERT_EQ(unnamed->get_links().size(), 1);
+    EXPECT_EQ(unnamed->get_links()[0].status, link_status::MISSING);
+    EXPECT_THAT(compiler_.generate(*linked, amps::user_map{{"value", "ok"}}),
+                "linked ok|");
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("code.insert.missing cannot be accessed"));
+}
+
+TEST_F (compiler_test, test_shared_inserts)
+{
+    using amps::link_status;
+
+    auto write = [](const std::string &name, const std::string &content) {
+        std::ofstream out(name);
+        out << content;
+    };
+
+    // templates compiled separately share the files they insert
+    write("code.insert.shared", "shared");
+    scan_.do_scan("a {% insert \"code.insert.shared\" %}");
+    amps::template_ptr first = scan_.get_template();
+    scan_.do_scan("b {% insert \"./code.insert.shared\" %}");
+    amps::template_ptr second = scan_.get_template();
+    ASSERT_NE(first->get_links()[0].unit, nullptr);
+    EXPECT_EQ(first->get_links()[0].unit, second->get_links()[0].unit);
+    EXPECT_EQ(scan_.get_units().size(), 1);
+
+    // until the file changes
+    write("code.insert.shared", "shared again");
+    scan_.do_scan("c {% insert \"code.insert.shared\" %}");
+    amps::template_ptr third = scan_.get_template();
+    EXPECT_NE(third->get_links()[0].unit, first->get_links()[0].unit);
+    EXPECT_THAT(compiler_.generate(*third, amps::user_map{}), "c shared again");
+    EXPECT_THAT(compiler_.generate(*first, amps::user_map{}), "a shared");
+
+    // or it's invalidated
+    scan_.get_units().invalidate(amps::canonical_path("code.insert.shared"));
+    EXPECT_EQ(scan_.get_units().size(), 0);
+    std::remove("code.insert.shared");
+
+    // a file with the same content as the one inserting it isn't the
+    // same file, the cycle is only found when the copy inserts itself
+    write("code.insert.twin", "[{% insert \"code.insert.copy\" %}]");
+    write("code.insert.copy", "[{% insert \"code.insert.copy\" %}]");
+    set_file("code.insert.twin");
+    amps::template_ptr twin = scan_.get_template();
+    std::remove("code.insert.twin");
+    std::remove("code.insert.copy");
+
+    const auto &copy = twin->get_links()[0];
+    ASSERT_EQ(copy.status, link_status::LINKED);
+    EXPECT_EQ(copy.unit->get_links()[0].status, link_status::CYCLE);
+    EXPECT_EQ(scan_.get_units().size(), 0);
+}
+
+TEST_F (compiler_test, test_optimized_output)
+{
+    // the optimized template renders exactly what the original does
+    const std::array<std::string, 11> templates = {
+        "{= 60 * 60 * 24 =}|{= -5 + 2 =}|{= \"a\" + \"b\" =}|{= 2 gt 1 =}",
+        "{% if 1 eq 1 %}one{% else %}other{% endif %}",
+        "{% if 0 %}a{% elif value %}b{= value =}{% elif 1 %}c{% endif %}",
+        "{% if not \"\" %}a{% if value %}b{% endif %}{% endif %}c",
+        "{% if false %}a{% elif false %}b{% else %}c{= 2 * 3 =}{% endif %}",
+        "{% if 0 %}a{% endif %}b{% if 1 %}{% endif %}c",
+        "{% for i in range(-5, 6, 1 + 1) %}{= i =},{% endfor %}",
+        "{% for i in items %}{= i =}{% if 2 ne 2 %}x{% endif %}-{% endfor %}",
+        "{% if 1 / 0 %}a{% endif %}{= 1 % 0 =}{= \"a\" + 1 =}|{= value =}",
+        "{= 0 and value =}{= 1 and value =}{= 0 or value =}{= 2 or 1 / 0 =}",
+        "{% if value and 1 or 0 %}a{% endif %}{= (0 or value) and 3 =}",
+    };
+
+    amps::user_map usermap{
+        {"value", "v"},
+        {"items", amps::v_string{"x", "y"}}
+    };
+
+    for (const auto &tpl : templates) {
+        scan_.do_scan(tpl);
+        std::string plain = compile(usermap);
+
+        scan_.do_scan(tpl);
+        amps::template_ptr optimized = scan_.get_template(true);
+        EXPECT_THAT(compiler_.generate(*optimized, usermap), plain) << tpl;
+    }
+}
+
+TEST_F (compiler_test, test_optimized_program)
+{
+    using amps::opcode;
+
+    auto ops = [](const amps::template_ptr &tpl) {
+        std::vector<opcode> result;
+        for (const auto &ins : tpl->get_program().code) {
+            result.push_back(ins.op);
+        }
+        return result;
+    };
+
+    // literal prints end up in a single piece of static text
+    scan_.do_scan("day: {= 60 * 60 * 24 =} seconds{% if 1 eq 1 %}!{% endif %}");
+    amps::template_ptr folded = scan_.get_template(true);
+    ASSERT_THAT(ops(folded), testing::ElementsAre(opcode::STATIC));
+    EXPECT_THAT(compiler_.generate(*folded, amps::user_map{}),
+                "day: 86400 seconds!");
+
+    // only the clauses that can be taken remain
+    scan_.do_scan("{% if 0 %}a{% elif value %}b{% elif 1 %}c"
+                  "{% else %}d{% endif %}");
+    amps::template_ptr chain = scan_.get_template(true);
+    EXPECT_THAT(ops(chain), testing::ElementsAre(
+                opcode::IF, opcode::LOAD, opcode::TEST, opcode::TEXT,
+                opcode::ELSE, opcode::TEXT, opcode::ENDIF));
+    EXPECT_THAT(compiler_.generate(*chain, amps::user_map{{"value", ""}}), "c");
+
+    // a literal deciding an and/or drops the other side
+    scan_.do_scan("{= 0 and value =}{% if 1 and value %}{% endif %}");
+    EXPECT_THAT(ops(scan_.get_template(true)), testing::ElementsAre(
+                opcode::STATIC, opcode::IF, opcode::LOAD, opcode::TO_BOOL,
+                opcode::TEST, opcode::ENDIF));
+
+    // the range is checked once, when it's compiled
+    scan_.do_scan("{% for i in range(-5, 6, 1) %}{% endfor %}");
+    EXPECT_THAT(ops(scan_.get_template(true)), testing::ElementsAre(
+                opcode::FOR, opcode::DECLARE, opcode::PUSH_NUMBER,
+                opcode::PUSH_NUMBER, opcode::PUSH_NUMBER,
+                opcode::LOOP_RANGE, opcode::ENDFOR));
+
+    // an insert that can never run isn't even read
+    scan_.do_scan("{% if false %}{% insert \"code.insert.missing\" %}{% endif %}"
+                  "{% insert \"code.insert.5\" %}");
+    amps::template_ptr inserts = scan_.get_template(true);
+    ASSERT_EQ(inserts->get_links().size(), 1);
+    EXPECT_EQ(inserts->get_links()[0].status, amps::link_status::LINKED);
+    EXPECT_THAT(inserts->get_dependencies(),
+                testing::Not(testing::Contains("code.insert.missing")));
+
+    // long text isn't copied, it's still a slice of the source, short
+    // pieces are only joined with each other
+    std::string text(100, 'x');
+    scan_.do_scan(text + "{= 1 + 1 =}-{% if 1 %}.{% endif %}" + text);
+    amps::template_ptr slices = scan_.get_template(true);
+    ASSERT_THAT(ops(slices), testing::ElementsAre(
+                opcode::TEXT, opcode::STATIC, opcode::TEXT));
+    const auto &code = slices->get_program().code;
+    const auto &info = slices->get_metainfo();
+    EXPECT_EQ(info[code[0].a].data.data(), info.source().data());
+    EXPECT_EQ(code[0].b, text.size());
+    EXPECT_EQ(slices->get_program().strings[code[1].a], "2-.");
+    EXPECT_EQ(code[2].b, text.size());
+    EXPECT_THAT(compiler_.generate(*slices, amps::user_map{}),
+                text + "2-." + text);
+
+    // text next to text in the source is a longer slice of it
+    auto source = std::make_shared<const std::string>(text + text);
+    amps::metainfo halves;
+    halves.set_source(source, *source);
+    halves.add_metadata(amps::metadata{amps::metatype::TEXT, {0, 100, 0},
+                                       std::string_view(*source).substr(0, 100), {}});
+    halves.add_metadata(amps::metadata{amps::metatype::TEXT, {100, 200, 0},
+                                       std::string_view(*source).substr(100), {}});
+    auto joined = std::make_shared<amps::compiled_template>(std::move(halves));
+    amps::linker(error_, true).link(*joined);
+    ASSERT_EQ(joined->get_program().code.size(), 1);
+    EXPECT_EQ(joined->get_program().code[0].op, opcode::TEXT);
+    EXPECT_EQ(joined->get_program().code[0].b, 200);
+    EXPECT_THAT(compiler_.generate(*joined, amps::user_map{}), text + text);
+
+    // errors are left to the render
+    scan_.do_scan("{= 1 / 0 =}");
+    amps::template_ptr failing = scan_.get_template(true);
+    EXPECT_THAT(compiler_.generate(*failing, amps::user_map{}), "<null>");
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("cannot divide by 0"));
+}
+
+TEST_F (compiler_test, test_output_size)
+{
+    // code.insert.5 prints its own text plus the text of code.insert.6
+    set_file("code.insert.5");
+    amps::template_ptr unit = scan_.get_template();
+    std::string unit_output = compiler_.generate(*unit, amps::user_map{});
+
+    scan_.do_scan("static {% if value %}{= value =}{% endif %} text"
+                  "{% insert \"code.insert.5\" %}");
+    amps::template_ptr tpl = scan_.get_template();
+    EXPECT_EQ(tpl->static_size(), 12 + unit->static_size());
+    EXPECT_EQ(tpl->size_hint(), 0);
+
+    // text that may not be printed, or printed many times, isn't static
+    scan_.do_scan("a{% if value %}bbbb{% insert \"code.insert.5\" %}"
+                  "{% else %}cccc{% endif %}"
+                  "{% for i in range(0, 10, 1) %}dddd{% endfor %}e");
+    EXPECT_EQ(scan_.get_template()->static_size(), 2);
+
+    std::string output = compiler_.generate(*tpl,
+                                            amps::user_map{{"value", "12345"}});
+    EXPECT_EQ(output, "static 12345 text" + unit_output);
+    EXPECT_EQ(tpl->size_hint(), output.size());
+}
+
+TEST_F (compiler_test, test_compact_values)
+{
+    using amps::object_t;
+    using amps::vobject_types;
+
+    // strings from the template or the user data are referenced
+    std::string literal("literal");
+    object_t view(literal);
+    EXPECT_EQ(view.get_view_or("").data(), literal.data());
+    EXPECT_EQ(&view.get_ref_or(amps::empty_string), &literal);
+    EXPECT_EQ(&object_t(amps::number_t(1)).get_ref_or(amps::empty_string),
+              &amps::empty_string);
+    EXPECT_THAT(view.get_number_or(7), 7);
+
+    // a string built while rendering is owned, copies are independent
+    auto built = amps::apply_binary(amps::token_types::PLUS,
+                                    object_t(literal), object_t(literal));
+    ASSERT_NE(built, std::nullopt);
+    object_t copy = built.value().clone();
+    EXPECT_NE(copy.get_view_or("").data(), built.value().get_view_or("").data());
+    built.reset();
+    EXPECT_THAT(copy.get_string_or(""), "literalliteral");
+
+    object_t moved(std::move(copy));
+    EXPECT_THAT(moved.get_type(), vobject_types::STRING);
+    EXPECT_THAT(moved.to_string(), "literalliteral");
+
+    EXPECT_TRUE(object_t(true).is_true());
+    EXPECT_FALSE(object_t(amps::number_t(0)).is_true());
+    EXPECT_FALSE(object_t(amps::empty_string).is_true());
+}
+
+TEST_F (compiler_test, test_stack_depth)
+{
+    scan_.do_scan("{= 1 + 2 * 3 =}{% for i in range(0, 2, 1) %}{% endfor %}");
+    EXPECT_EQ(scan_.get_template()->get_program().depth, 3);
+
+    // deeper than the inline storage of the stack
+    std::string nested("{= ");
+    for (size_t i = 0; i < 40; ++i) {
+        nested += "1 + (";
+    }
+    nested += "1";
+    nested += std::string(40, ')');
+    nested += " =}";
+
+    scan_.do_scan(nested);
+    amps::template_ptr deep = scan_.get_template();
+    EXPECT_EQ(deep->get_program().depth, 41);
+    EXPECT_THAT(compiler_.generate(*deep, amps::user_map{}), "41");
+
+    // values only move through the stack, an empty one has no top
+    static_assert(!std::is_copy_constructible_v<amps::object_t>);
+    amps::gstack stack;
+    EXPECT_EQ(stack.look_back(), std::nullopt);
+    EXPECT_EQ(stack.pop(), std::nullopt);
+
+    std::string literal("literal");
+    stack.emplace(literal);
+    stack.push(amps::object_t(literal + literal));
+    EXPECT_THAT(stack.look_back().value().get_view_or(""), "literalliteral");
+    stack.pop();
+    EXPECT_EQ(stack.look_back().value().get_view_or("").data(), literal.data());
+    stack.clear();
+    EXPECT_TRUE(stack.empty());
+}
+
+TEST_F (compiler_test, test_short_circuit)
+{
+    amps::user_map usermap{
+        {"yes", amps::number_t(1)},
+        {"no", amps::number_t(0)},
+        {"table", amps::m_string{{"key", "value"}}}
+    };
+
+    // the right side isn't evaluated, a missing key is never looked up
+    scan_.do_scan("{% if no and table[\"missing\"] %}a{% endif %}"
+                  "{% if yes or table[\"missing\"] %}b{% endif %}"
+                  "{= no and 1 / 0 =}|{= yes or undefined =}");
+    EXPECT_THAT(compile(usermap), "bfalse|true");
+    EXPECT_THAT(error_.get_last_error_msg(), "");
+
+    // otherwise the result is the right side as a bool
+    scan_.do_scan("{= yes and table[\"key\"] =}|{= no or \"\" =}|"
+                  "{= no or yes and 2 =}|{= yes and no or yes =}");
+    EXPECT_THAT(compile(usermap), "true|false|true|true");
+
+    scan_.do_scan("{% if yes and table[\"missing\"] %}a{% endif %}");
+    EXPECT_THAT(compile(usermap), "");
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("[missing] not found"));
+}
+
+TEST_F (compiler_test, test_print_numbers)
+{
+    amps::v_number cells;
+    std::string expected;
+    for (int64_t i = -500; i < 500; i += 11) {
+        cells.push_back(static_cast<amps::number_t>(i * 1000003));
+        expected += std::to_string(i * 1000003) + ",";
+    }
+
+    scan_.do_scan("{% for n in numbers %}{= n =},{% endfor %}");
+    amps::user_map table{{"numbers", cells}};
+    EXPECT_THAT(compile(table), expected);
+
+    scan_.do_scan("{= 0 =}|{= -1 =}|{= 0 - 2 =}|"
+                  "{= large =}|{= true =}|{= map =}");
+    amps::user_map usermap{
+        {"large", amps::number_t(9223372036854775807ull)},
+        {"map", amps::m_number{{"a", 1}}}
+    };
+    EXPECT_THAT(compile(usermap),
+                "0|-1|-2|9223372036854775807|true|false");
+}
+
+TEST_F (compiler_test, test_blank_text)
+{
+    // a line with nothing but spaces and tabs is dropped with its
+    // newline, an empty line is kept
+    scan_.do_scan("a\n\nb\n");
+    EXPECT_EQ(compile(), "a\n\nb\n");
+
+    scan_.do_scan("a\n  \t\nb\n   \n\nc");
+    EXPECT_EQ(compile(), "a\nb\n\nc");
+
+    // so is the indentation of a code block, a code block ending a
+    // line takes its newline, the indentation of an echo is kept
+    scan_.do_scan("a\n    {% if true %}\n  b\n    {% endif %}\n  {= 1 =}\n");
+    EXPECT_EQ(compile(), "a\n  b\n  1\n");
+
+    // text around the code is written as it is
+    scan_.do_scan("  a  {% if true %}  b  {% endif %}  c  ");
+    EXPECT_EQ(compile(), "  a    b    c  ");
+}
+
+TEST_F (compiler_test, test_broken_sink)
+{
+    // the inserted file prints enough to fill a few chunks
+    {
+        std::ofstream out("code.insert.rows");
+        out << "{% for i in range(0, 50, 1) %}row {= i =}\n{% endfor %}";
+    }
+    scan_.do_scan("{% insert \"code.insert.rows\" %}"
+                  "{% for i in range(0, 50, 1) %}{= i =}{% endfor %}");
+    amps::template_ptr tpl = scan_.get_template();
+    std::remove("code.insert.rows");
+
+    size_t steps = 0;
+    compiler_.set_callback([&steps](const amps::context &,
+                                    const std::vector<amps::branch> &) {
+        ++steps;
+    });
+
+    std::ostringstream all;
+    amps::ostream_sink accepting(all, 64);
+    EXPECT_TRUE(compiler_.generate(*tpl, amps::user_map{}, accepting));
+    size_t full = steps;
+    size_t learned = tpl->size_hint();
+    EXPECT_EQ(learned, all.str().size());
+
+    // the render stops at the first chunk the sink refuses, neither the
+    // rest of the insert nor the template inserting it run
+    steps = 0;
+    size_t calls = 0;
+    amps::callback_sink refusing([&calls](std::string_view) {
+        ++calls;
+        return false;
+    }, 64);
+    EXPECT_FALSE(compiler_.generate(*tpl, amps::user_map{}, refusing));
+    EXPECT_EQ(calls, 1);
+    EXPECT_LT(steps, full / 4);
+    EXPECT_EQ(tpl->size_hint(), learned);
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("output cannot be written"));
+}
+
+TEST_F (compiler_test, test_unbalanced_insert)
+{
+    // the closing statements of an inserted file don't match the blocks
+    // of the template inserting it
+    {
+        std::ofstream out("code.insert.unbalanced");
+        out << "a{% endfor %}b{% else %}c{% endif %}";
+    }
+    scan_.do_scan("{% for x in range(0, 3, 1) %}"
+                  "{% if true %}<{% insert \"code.insert.unbalanced\" %}>"
+                  "{% endif %}{% endfor %}");
+    amps::template_ptr tpl = scan_.get_template();
+    std::remove("code.insert.unbalanced");
+
+    EXPECT_EQ(compiler_.generate(*tpl, amps::user_map{}), "<abc><abc><abc>");
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("expected ENDIF, ELSE, or ELIF"));
+}
+
+TEST_F (compiler_test, test_large_text_sink)
+{
+    // text bigger than a chunk is written on its own, what was printed
+    // before it goes out first
+    std::string large(1000, 'x');
+    scan_.do_scan("{% for i in range(0, 3, 1) %}{= i =}" + large +
+                  "{% endfor %}end");
+    amps::template_ptr tpl = scan_.get_template();
+
+    std::string all;
+    size_t largest = 0;
+    amps::callback_sink recording([&all, &largest](std::string_view data) {
+        all += data;
+        largest = std::max(largest, data.size());
+        return true;
+    }, 64);
+    EXPECT_TRUE(compiler_.generate(*tpl, amps::user_map{}, recording));
+    EXPECT_EQ(all, "0" + large + "1" + large + "2" + large + "end");
+    EXPECT_EQ(largest, large.size());
+    EXPECT_EQ(tpl->size_hint(), all.size());
+}
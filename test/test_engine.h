@@ -0,0 +1,258 @@
+#include "../include/engine.h"
+#include "mock_error.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class engine_test : public ::testing::Test
+{
+protected:
+    mock_error error_;
+    amps::engine engine_;
+    std::string dir_;
+
+    engine_test() :
+        engine_(error_),
+        dir_("engine.templates")
+    {
+    }
+
+    void write(const std::string &name, const std::string &content)
+    {
+        std::ofstream file(dir_ + "/" + name);
+        file << content;
+    }
+
+    void SetUp() override
+    {
+        std::filesystem::create_directory(dir_);
+        engine_.set_template_directory(dir_);
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove_all(dir_);
+    }
+};
+
+TEST_F (engine_test, test_named_templates)
+{
+    write("a", "template a");
+    write("b", "template b");
+
+    engine_.prepare_template("a");
+    engine_.prepare_template("b");
+
+    amps::user_map um {{"", ""}};
+    EXPECT_THAT(engine_.render("a", um), "template a");
+    EXPECT_THAT(engine_.render("b", um), "template b");
+    EXPECT_THAT(engine_.render(um), "template b");
+    EXPECT_THAT(engine_.render("c", um), "");
+}
+
+TEST_F (engine_test, test_dependencies)
+{
+    write("page", "{% insert \"engine.templates/header\" %}"
+                  "{% insert \"engine.templates/footer\" %}");
+    write("header", "header {% insert \"engine.templates/title\" %}");
+    write("title", "title");
+
+    engine_.prepare_template("page");
+    auto deps = engine_.get_template("page")->get_dependencies();
+    std::sort(deps.begin(), deps.end());
+
+    // a missing file is a dependency too, it may show up later
+    ASSERT_EQ(deps.size(), 3);
+    EXPECT_EQ(deps[0], "engine.templates/footer");
+    EXPECT_EQ(deps[1], "engine.templates/header");
+    EXPECT_EQ(deps[2], "engine.templates/title");
+}
+
+#ifdef __linux__
+TEST_F (engine_test, test_hot_reload)
+{
+    write("page", "[{% insert \"engine.templates/header\" %}]");
+    write("header", "header");
+    write("other", "other");
+
+    engine_.prepare_template("other");
+    engine_.prepare_template("page");
+    ASSERT_TRUE(engine_.watch());
+
+    amps::user_map um {{"", ""}};
+    EXPECT_EQ(engine_.refresh(), 0);
+    EXPECT_THAT(engine_.render("page", um), "[header]");
+
+    // only the template inserting the file is compiled again
+    auto other = engine_.get_template("other");
+    write("header", "new header");
+    EXPECT_EQ(engine_.refresh(), 1);
+    EXPECT_THAT(engine_.render("page", um), "[new header]");
+    EXPECT_THAT(engine_.render(um), "[new header]");
+    EXPECT_EQ(engine_.get_template("other"), other);
+
+    write("page", "page");
+    EXPECT_EQ(engine_.refresh(), 1);
+    EXPECT_THAT(engine_.render("page", um), "page");
+
+    // the header isn't inserted anymore
+    write("header", "header");
+    EXPECT_EQ(engine_.refresh(), 0);
+
+    write("unrelated", "unrelated");
+    EXPECT_EQ(engine_.refresh(), 0);
+}
+#endif
+
+TEST_F (engine_test, test_shared_inserts)
+{
+    write("header", "header");
+    write("one", "1 {% insert \"engine.templates/header\" %}");
+    write("two", "2 {% insert \"engine.templates/header\" %}");
+
+    // the header is compiled once for both pages
+    engine_.prepare_template("one");
+    engine_.prepare_template("two");
+    auto header = engine_.get_template("one")->get_links()[0].unit;
+    ASSERT_NE(header, nullptr);
+    EXPECT_EQ(engine_.get_template("two")->get_links()[0].unit, header);
+
+#ifdef __linux__
+    ASSERT_TRUE(engine_.watch());
+
+    // and again once when it changes
+    write("header", "HEADER");
+    EXPECT_EQ(engine_.refresh(), 2);
+
+    amps::user_map um {{"", ""}};
+    EXPECT_THAT(engine_.render("one", um), "1 HEADER");
+    EXPECT_THAT(engine_.render("two", um), "2 HEADER");
+    auto changed = engine_.get_template("one")->get_links()[0].unit;
+    EXPECT_NE(changed, header);
+    EXPECT_EQ(engine_.get_template("two")->get_links()[0].unit, changed);
+#endif
+}
+
+TEST_F (engine_test, test_render_sinks)
+{
+    using amps::number_t;
+
+    write("rows", "{% for i in range(0, 90, 1) %}row {= i =} of {= total =}\n"
+                  "{% endfor %}");
+    engine_.prepare_template("rows");
+
+    amps::user_map um {{"total", number_t(90)}};
+    std::string expected = engine_.render("rows", um);
+
+    // chunks are handed over while rendering, none much bigger than
+    // the chunk size
+    std::vector<std::string> chunks;
+    amps::callback_sink chunked([&](std::string_view chunk) {
+        chunks.emplace_back(chunk);
+        return true;
+    }, 64);
+
+    EXPECT_TRUE(engine_.render("rows", um, chunked));
+    ASSERT_GT(chunks.size(), 10);
+    std::string joined;
+    for (const auto &chunk : chunks) {
+        EXPECT_LT(chunk.size(), 64 + 20);
+        joined += chunk;
+    }
+    EXPECT_THAT(joined, expected);
+
+    std::ostringstream stream;
+    amps::ostream_sink to_stream(stream);
+    EXPECT_TRUE(engine_.render(um, to_stream));
+    EXPECT_THAT(stream.str(), expected);
+
+#ifdef __linux__
+    std::string filename = dir_ + "/output";
+    int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    amps::fd_sink to_file(fd);
+    EXPECT_TRUE(engine_.render(um, to_file));
+    close(fd);
+
+    std::ifstream written(filename);
+    EXPECT_THAT(std::string(std::istreambuf_iterator<char>(written),
+                            std::istreambuf_iterator<char>()), expected);
+
+    amps::fd_sink closed(fd);
+    EXPECT_FALSE(engine_.render(um, closed));
+#endif
+
+    // a sink refusing the output stops receiving it
+    size_t calls = 0;
+    amps::callback_sink refusing([&](std::string_view) {
+        ++calls;
+        return false;
+    }, 64);
+    EXPECT_FALSE(engine_.render("rows", um, refusing));
+    EXPECT_EQ(calls, 1);
+    EXPECT_THAT(error_.get_last_error_msg(),
+                testing::HasSubstr("output cannot be written"));
+
+    EXPECT_FALSE(engine_.render("missing", um, to_stream));
+}
+
+TEST_F (engine_test, test_gather_output)
+{
+    using amps::number_t;
+
+    std::string header(200, 'h');
+    std::string footer(100, 'f');
+    write("page", header + "{% for i in range(0, 3, 1) %}<{= i =}>"
+                  "{% endfor %}{% insert \"engine.templates/footer\" %}");
+    write("footer", footer + "{= total =}");
+    engine_.prepare_template("page");
+
+    amps::user_map um {{"total", number_t(3)}};
+    std::string expected = engine_.render("page", um);
+
+    amps::gather_output out;
+    ASSERT_TRUE(engine_.render("page", um, out));
+    EXPECT_THAT(out.str(), expected);
+    EXPECT_EQ(out.size(), expected.size());
+
+    // the long pieces of text are the template's own, not copies
+    auto tpl = engine_.get_template("page");
+    const auto &segments = out.segments();
+    ASSERT_EQ(segments.size(), 4);
+    EXPECT_EQ(segments[0].iov_base,
+              tpl->get_metainfo()[0].data.data());
+    EXPECT_EQ(segments[0].iov_len, header.size());
+    EXPECT_EQ(std::string(static_cast<const char*>(segments[1].iov_base),
+                          segments[1].iov_len), "<0><1><2>");
+    EXPECT_EQ(segments[2].iov_len, footer.size());
+    EXPECT_EQ(segments[3].iov_len, 1);
+
+    // the output keeps the template, even once it's replaced
+    write("page", "replaced");
+    engine_.prepare_template("page");
+    EXPECT_THAT(out.str(), expected);
+
+#ifdef __linux__
+    std::string filename = dir_ + "/output";
+    int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    EXPECT_TRUE(out.write_to(fd));
+    close(fd);
+
+    std::ifstream written(filename);
+    EXPECT_THAT(std::string(std::istreambuf_iterator<char>(written),
+                            std::istreambuf_iterator<char>()), expected);
+#endif
+
+    EXPECT_FALSE(engine_.render("missing", um, out));
+    EXPECT_EQ(out.size(), 0);
+}
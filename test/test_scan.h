@@ -1,4 +1,6 @@
 #include "../include/scan.h"
+#include "../include/simd.h"
+#include "../include/fileops.h"
 #include "mock_error.h"
 
 #include <string>
@@ -70,14 +72,13 @@ TEST_F (scan_test, valid_and_invalid_blocks_all)
     using amps::metatype;
     using testing::StartsWith;
 
-    std::array<metatype, 33> expected = {
+    // adjacent text blocks are merged into a single one
+    std::array<metatype, 25> expected = {
         metatype::CODE, metatype::COMMENT, metatype::CODE, metatype::COMMENT, metatype::CODE,
-        metatype::COMMENT, metatype::TEXT, metatype::TEXT, metatype::TEXT, metatype::TEXT,
-        metatype::TEXT, metatype::ECHO, metatype::TEXT, metatype::CODE, metatype::CODE,
-        metatype::CODE, metatype::CODE, metatype::TEXT, metatype::TEXT, metatype::TEXT,
-        metatype::TEXT, metatype::COMMENT, metatype::CODE, metatype::TEXT, metatype::ECHO,
-        metatype::TEXT, metatype::ECHO, metatype::TEXT, metatype::ECHO, metatype::TEXT,
-        metatype::COMMENT, metatype::TEXT, metatype::TEXT,
+        metatype::COMMENT, metatype::TEXT, metatype::ECHO, metatype::TEXT, metatype::CODE,
+        metatype::CODE, metatype::CODE, metatype::CODE, metatype::TEXT, metatype::COMMENT,
+        metatype::CODE, metatype::TEXT, metatype::ECHO, metatype::TEXT, metatype::ECHO,
+        metatype::TEXT, metatype::ECHO, metatype::TEXT, metatype::COMMENT, metatype::TEXT,
     };
 
     std::ifstream file("block.2");
@@ -252,9 +253,8 @@ TEST_F (scan_test, find_code_between_trash)
         std::getline(file, content);
         scan_.do_scan(content);
         auto &data = scan_.get_metainfo();
-        EXPECT_EQ(data.size(), 2);
+        EXPECT_EQ(data.size(), 1);
         EXPECT_EQ(data[0].type, metatype::TEXT);
-        EXPECT_EQ(data[1].type, metatype::TEXT);
     }
 
     {
@@ -262,9 +262,8 @@ TEST_F (scan_test, find_code_between_trash)
         std::getline(file, content);
         scan_.do_scan(content);
         auto &data = scan_.get_metainfo();
-        EXPECT_EQ(data.size(), 2);
+        EXPECT_EQ(data.size(), 1);
         EXPECT_EQ(data[0].type, metatype::TEXT);
-        EXPECT_EQ(data[1].type, metatype::TEXT);
     }
 
     {
@@ -272,9 +271,8 @@ TEST_F (scan_test, find_code_between_trash)
         std::getline(file, content);
         scan_.do_scan(content);
         auto &data = scan_.get_metainfo();
-        EXPECT_EQ(data.size(), 2);
+        EXPECT_EQ(data.size(), 1);
         EXPECT_EQ(data[0].type, metatype::TEXT);
-        EXPECT_EQ(data[1].type, metatype::TEXT);
     }
 
     {
@@ -320,9 +318,8 @@ TEST_F (scan_test, find_code_between_trash)
         std::getline(file, content);
         scan_.do_scan(content);
         auto &data = scan_.get_metainfo();
-        EXPECT_EQ(data.size(), 2);
+        EXPECT_EQ(data.size(), 1);
         EXPECT_EQ(data[0].type, metatype::TEXT);
-        EXPECT_EQ(data[1].type, metatype::TEXT);
     }
 }
 
@@ -586,3 +583,217 @@ TEST_F (scan_test, test_scan)
         EXPECT_EQ(data[0].tokens[10].type(), token_types::RIGHT_BRACKET);
     }
 }
+
+TEST_F (scan_test, test_token_values)
+{
+    using amps::token_types;
+
+    static_assert(std::is_trivially_copyable_v<amps::token_t>);
+
+    // token text views the scanned code, it's not copied
+    scan_.do_scan("{% for item in range(0, 42, 1) %}");
+    auto &code = scan_.get_metainfo();
+    ASSERT_EQ(code.size(), 1);
+    ASSERT_EQ(code[0].tokens.size(), 11);
+    EXPECT_EQ(code[0].tokens[1].type(), token_types::IDENTIFIER);
+    EXPECT_EQ(code[0].tokens[1].value(code[0].data), "item");
+    EXPECT_EQ(code[0].tokens[2].value(code[0].data), "");
+    EXPECT_EQ(code[0].tokens[5].type(), token_types::NUMBER);
+    EXPECT_EQ(code[0].tokens[5].value(code[0].data), "0");
+    EXPECT_EQ(code[0].tokens[7].value(code[0].data), "42");
+
+    scan_.do_scan("{= map[\"key\"] =}");
+    auto &echo = scan_.get_metainfo();
+    ASSERT_EQ(echo.size(), 1);
+    ASSERT_EQ(echo[0].tokens.size(), 5);
+    EXPECT_EQ(echo[0].tokens[1].value(echo[0].data), "map");
+    EXPECT_EQ(echo[0].tokens[3].type(), token_types::STRING);
+    EXPECT_EQ(echo[0].tokens[3].value(echo[0].data), "key");
+}
+
+TEST_F (scan_test, test_content_hash)
+{
+    std::string content = "text {% print value %} more text";
+
+    scan_.do_scan(content);
+    uint64_t hash = scan_.get_metainfo().hash();
+
+    // reading the metainfo again doesn't change its identity
+    EXPECT_EQ(scan_.get_metainfo().hash(), hash);
+    EXPECT_EQ(scan_.get_metainfo().hash(), amps::content_hash(content));
+
+    scan_.do_scan(content);
+    EXPECT_EQ(scan_.get_metainfo().hash(), hash);
+
+    scan_.do_scan("text {% print other %} more text");
+    EXPECT_NE(scan_.get_metainfo().hash(), hash);
+
+    scan_.do_scan(content);
+    EXPECT_EQ(scan_.get_template()->hash(), hash);
+}
+
+TEST_F (scan_test, test_simd_search)
+{
+    // every length and position around the vector width, so both the
+    // vector loop and the scalar tail find the byte
+    for (size_t size = 0; size < 80; ++size) {
+        for (size_t at = 0; at <= size; ++at) {
+            std::string text(size, ' ');
+            if (at < size) {
+                text[at] = '{';
+            }
+
+            EXPECT_EQ(amps::simd::find_any(text.data(), size, '{', '\n'), at);
+            EXPECT_EQ(amps::simd::find_other(text.data(), size, ' ', '\t'), at);
+            EXPECT_EQ(amps::simd::count(text.data(), size, '{'),
+                      (at < size) ? 1 : 0);
+        }
+    }
+}
+
+TEST_F (scan_test, test_bulk_line_count)
+{
+    std::string content;
+    for (size_t i = 0; i < 100; ++i) {
+        content += "some text in a line long enough to need several blocks\n";
+    }
+    content += "{% if value\n\n\n and other %}\n";
+    content += "{= value =}";
+
+    scan_.do_scan(content);
+    auto &data = scan_.get_metainfo();
+    ASSERT_EQ(data.size(), 3);
+
+    // all the lines of text before the first tag are a single segment
+    EXPECT_EQ(data[0].type, amps::metatype::TEXT);
+    EXPECT_EQ(data[0].data, content.substr(0, content.find('{')));
+
+    // lines inside a code block are counted too, even if the block
+    // itself is invalid
+    EXPECT_EQ(data[1].type, amps::metatype::COMMENT);
+    EXPECT_EQ(data[1].range.line, 103);
+    EXPECT_EQ(data[2].type, amps::metatype::ECHO);
+    EXPECT_EQ(data[2].range.line, 104);
+}
+
+TEST_F (scan_test, test_keywords)
+{
+    using amps::token_types;
+    using amps::get_keyword;
+
+    static_assert(get_keyword("endfor") == token_types::ENDFOR);
+    static_assert(get_keyword("endfo") == token_types::IDENTIFIER);
+
+#define X(kw, name) EXPECT_EQ(get_keyword(kw), token_types::name);
+    KEYWORDS
+#undef X
+
+    EXPECT_EQ(get_keyword(""), token_types::IDENTIFIER);
+    EXPECT_EQ(get_keyword("True"), token_types::IDENTIFIER);
+    EXPECT_EQ(get_keyword("iff"), token_types::IDENTIFIER);
+    EXPECT_EQ(get_keyword("elsif"), token_types::IDENTIFIER);
+    EXPECT_EQ(get_keyword("prints"), token_types::IDENTIFIER);
+    EXPECT_EQ(get_keyword("insert_"), token_types::IDENTIFIER);
+}
+
+TEST_F (scan_test, test_source_slices)
+{
+    using amps::metatype;
+
+    scan_.do_scan("a{b {% print x %}\n{= y =}");
+    auto &data = scan_.get_metainfo();
+    std::string_view source = data.source();
+    ASSERT_EQ(data.size(), 3);
+
+    // every metadata is a view of the single copy of the content
+    for (const auto &mtdt : data) {
+        EXPECT_GE(mtdt.data.data(), source.data());
+        EXPECT_LE(mtdt.data.data() + mtdt.data.size(),
+                  source.data() + source.size());
+    }
+
+    // a '{' that doesn't open a tag is regular text, written once
+    EXPECT_EQ(data[0].type, metatype::TEXT);
+    EXPECT_EQ(data[0].data, "a{b ");
+    EXPECT_EQ(data[1].data, "print x");
+    EXPECT_EQ(data[2].type, metatype::ECHO);
+    EXPECT_EQ(data[2].data, "y");
+
+    // the slices still hold once the template owns the metainfo
+    auto tpl = scan_.get_template();
+    const auto &info = tpl->get_metainfo();
+    EXPECT_EQ(info.source().data(), source.data());
+    EXPECT_EQ(info[2].data, "y");
+    EXPECT_EQ(info[2].tokens[0].type(), amps::token_types::PRINT);
+    EXPECT_EQ(info[2].tokens[1].value(info[2].data), "y");
+}
+
+TEST_F (scan_test, test_text_across_blank_lines)
+{
+    using amps::metatype;
+
+    // an empty line is text of its own, the stretch stays a slice
+    scan_.do_scan("first\n\nsecond\n{% print x %}");
+    auto &data = scan_.get_metainfo();
+    std::string_view source = data.source();
+    ASSERT_EQ(data.size(), 2);
+    EXPECT_EQ(data[0].type, metatype::TEXT);
+    EXPECT_EQ(data[0].data, "first\n\nsecond\n");
+    EXPECT_EQ(data[0].data.data(), source.data());
+
+    // a blank line is dropped, the text around it is still a single
+    // metadata even though it isn't contiguous in the content
+    scan_.do_scan("first\n   \n\t\nsecond\nthird {= x =}");
+    ASSERT_EQ(data.size(), 2);
+    EXPECT_EQ(data[0].type, metatype::TEXT);
+    EXPECT_EQ(data[0].data, "first\nsecond\nthird ");
+    EXPECT_EQ(data[1].type, metatype::ECHO);
+
+    // and it outlives the scanner once the template owns it
+    auto tpl = scan_.get_template();
+    scan_.do_scan("other");
+    EXPECT_EQ(tpl->get_metainfo()[0].data, "first\nsecond\nthird ");
+}
+
+TEST_F (scan_test, test_load_file)
+{
+    using amps::metatype;
+
+    EXPECT_EQ(amps::load_file("does.not.exist"), nullptr);
+    EXPECT_EQ(amps::load_file("."), nullptr);
+
+    // the scanner can't rely on anything past the end of the content
+    std::string content(12288 - 9, 'x');
+    content += "\n{% print";
+    {
+        std::ofstream out("scan.loaded", std::ios::binary);
+        out << content;
+    }
+
+    auto file = amps::load_file("scan.loaded");
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(file->view(), content);
+
+    scan_.do_scan(file);
+    auto &data = scan_.get_metainfo();
+    EXPECT_EQ(data.source().data(), file->view().data());
+    ASSERT_EQ(data.size(), 1);
+    EXPECT_EQ(data[0].type, metatype::TEXT);
+    EXPECT_EQ(data[0].data, content);
+
+    // the content is a snapshot, a template outlives any change to
+    // its file
+    auto tpl = scan_.get_template();
+    {
+        std::ofstream out("scan.loaded", std::ios::binary | std::ios::trunc);
+        out << "changed";
+    }
+    EXPECT_EQ(tpl->get_metainfo()[0].data, content);
+
+    std::remove("scan.loaded");
+    EXPECT_EQ(tpl->get_metainfo()[0].data, content);
+
+    auto small = amps::load_file("block.4");
+    ASSERT_NE(small, nullptr);
+    EXPECT_GT(small->view().size(), 0);
+}